@@ -1,7 +1,9 @@
 #include "../src/Console.hpp"
 
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <thread>
 
 namespace cr = CppReadline;
 using ret = cr::Console::ReturnCode;
@@ -13,7 +15,8 @@ unsigned info(const std::vector<std::string> &) {
     return ret::Ok;
 }
 
-// In this command we implement a basic calculator
+// In this command we implement a basic calculator. Note that the Console
+// already provides the "expr" command for full arithmetic expressions.
 unsigned calc(const std::vector<std::string> & input) {
     if ( input.size() != 4 ) {
         // The first element of the input array is always the name of the
@@ -51,7 +54,7 @@ unsigned calc(const std::vector<std::string> & input) {
     return 0;
 }
 
-int main() {
+int main(int argc, char ** argv) {
     // We create a console. The '>' character is used as the prompt.
     // Note that multiple Consoles can exist at once, as they automatically
     // manage the underlying global readline state.
@@ -63,6 +66,43 @@ int main() {
     c.registerCommand("info", info);
     c.registerCommand("calc", calc);
 
+    // Asynchronous commands return a future of their result. When they are
+    // typed at the prompt the Console does not wait for them, and reports
+    // their result before a later prompt. Their work can be scheduled on the
+    // Console's own Executor.
+    c.registerAsyncCommand("wait", [&c](const std::vector<std::string> & input) {
+        auto seconds = input.size() > 1 ? std::stoi(input[1]) : 1;
+        auto done = std::make_shared<std::promise<int>>();
+        c.getExecutor().execute([done, seconds]{
+            std::this_thread::sleep_for(std::chrono::seconds(seconds));
+            done->set_value(ret::Ok);
+        });
+        return done->get_future();
+    });
+    // Arguments can be completed with Tab as well. Slow completers are started
+    // in the background as soon as the user pauses typing.
+    c.registerCompleter("wait", [](const std::vector<std::string> &, const std::string & word) {
+        std::vector<std::string> candidates;
+        for ( auto seconds : { "1", "2", "5", "10", "30" } )
+            if ( std::string(seconds).compare(0, word.size(), word) == 0 ) candidates.push_back(seconds);
+        return candidates;
+    });
+
+    // Contexts group commands under their own prompt: "enter net" makes only
+    // the commands of the "net" context available, until "exit" goes back.
+    c.registerContext("net", "net>");
+    // Commands can also print to the Console's own output buffer, which is
+    // written out in one go once the command is done.
+    c.registerCommand("net", "status", [&c](const std::vector<std::string> &) {
+        c.getOutput() << "All interfaces are up.\n";
+        return ret::Ok;
+    });
+
+    // When the program is given arguments, we run them as a single command
+    // and exit, e.g. "./cpp-readline-example calc 1 + 2". Its result becomes
+    // the exit status of the program.
+    if ( argc > 1 ) return c.executeArgv(argc, argv);
+
     // Here we call one of the defaults command of the console, "help". It lists
     // all currently registered commands within the console, so that the user
     // can know which commands are available.
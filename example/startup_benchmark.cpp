@@ -0,0 +1,35 @@
+#include "../src/Console.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+namespace cr = CppReadline;
+using ret = cr::Console::ReturnCode;
+
+// This benchmark measures how long it takes to go from nothing to the first
+// dispatched command, which is what batch tools calling executeCommand or
+// executeFile pay on every invocation.
+int main(int argc, char ** argv) {
+    using Clock = std::chrono::steady_clock;
+
+    const unsigned iterations = argc > 1 ? std::stoul(argv[1]) : 10000;
+    unsigned dispatched = 0;
+
+    auto start = Clock::now();
+    for ( unsigned i = 0; i < iterations; ++i ) {
+        cr::Console c(">");
+        c.registerCommand("noop", [&dispatched](const cr::Console::Arguments &) {
+            ++dispatched;
+            return ret::Ok;
+        });
+        c.executeCommand("noop");
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+
+    std::cout << "Time to first dispatch: "
+              << elapsed.count() / static_cast<double>(iterations) / 1000.0
+              << " us (average over " << dispatched << " runs)\n";
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include "AuditLog.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CppReadline {
+    struct AuditLog::Impl {
+        // A bounded multi-producer queue, where each slot is sequenced so
+        // that producers and the consumer never need a lock.
+        struct Slot {
+            std::atomic<size_t> sequence;
+            std::string         record;
+
+            Slot() : sequence(0), record() {}
+        };
+
+        Options                     options_;
+        std::shared_ptr<Executor>   executor_;
+
+        std::vector<Slot>           ring_;
+        std::atomic<size_t>         tail_;
+        // Only advanced by whoever is draining, but read by the previous drainer once it let go.
+        std::atomic<size_t>         head_{0};
+        std::atomic<bool>           draining_;
+        std::atomic<unsigned long>  dropped_;
+
+        int     fd_ = -1;
+        size_t  size_ = 0;
+
+        Impl(Options options, std::shared_ptr<Executor> executor) :
+                options_(std::move(options)), executor_(std::move(executor)),
+                ring_(options_.capacity > 0 ? options_.capacity : 1),
+                tail_(0), draining_(false), dropped_(0)
+        {
+            if ( ! executor_ ) executor_ = ThreadPool::getDefault();
+            for ( size_t i = 0; i < ring_.size(); ++i ) ring_[i].sequence = i;
+            open();
+        }
+
+        ~Impl() {
+            if ( fd_ >= 0 ) close(fd_);
+        }
+
+        Impl(Impl const&) = delete;
+        Impl(Impl&&) = delete;
+        Impl& operator = (Impl const&) = delete;
+        Impl& operator = (Impl&&) = delete;
+
+        void open() {
+            fd_ = ::open(options_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+            struct stat st;
+            size_ = ( fd_ >= 0 && fstat(fd_, &st) == 0 ) ? st.st_size : 0;
+        }
+
+        bool push(std::string record) {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            while ( true ) {
+                Slot & slot = ring_[tail % ring_.size()];
+                size_t sequence = slot.sequence.load(std::memory_order_acquire);
+                if ( sequence == tail ) {
+                    if ( tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed) ) {
+                        slot.record = std::move(record);
+                        slot.sequence.store(tail + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if ( sequence < tail ) {
+                    return false; // Full
+                } else {
+                    tail = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool pop(std::string & batch) {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            Slot & slot = ring_[head % ring_.size()];
+            if ( slot.sequence.load(std::memory_order_acquire) != head + 1 ) return false;
+
+            batch += slot.record;
+            slot.record.clear();
+            slot.sequence.store(head + ring_.size(), std::memory_order_release);
+            head_.store(head + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        void rotate() {
+            close(fd_);
+            for ( unsigned i = options_.maxFiles; i > 1; --i ) {
+                auto from = options_.path + '.' + std::to_string(i - 1);
+                auto to = options_.path + '.' + std::to_string(i);
+                std::rename(from.c_str(), to.c_str());
+            }
+            if ( options_.maxFiles > 0 )
+                std::rename(options_.path.c_str(), (options_.path + ".1").c_str());
+            else
+                std::remove(options_.path.c_str());
+            open();
+        }
+
+        void write(const std::string & batch) {
+            if ( options_.maxFileSize > 0 && size_ > 0 && size_ + batch.size() > options_.maxFileSize )
+                rotate();
+            if ( fd_ < 0 ) return;
+
+            size_t written = 0;
+            while ( written < batch.size() ) {
+                ssize_t r = ::write(fd_, batch.data() + written, batch.size() - written);
+                if ( r < 0 && errno == EINTR ) continue;
+                if ( r <= 0 ) break;
+                written += r;
+            }
+            size_ += written;
+            if ( options_.durability == Durability::Sync ) fdatasync(fd_);
+        }
+
+        // Must be called only by whoever set draining_.
+        void drain() {
+            std::string batch;
+            do {
+                batch.clear();
+                while ( pop(batch) );
+                if ( ! batch.empty() ) write(batch);
+                draining_.store(false, std::memory_order_release);
+                // Records pushed after our last pop need someone to drain them.
+            } while ( hasPending() && ! draining_.exchange(true, std::memory_order_acquire) );
+        }
+
+        bool hasPending() const {
+            // A stale head only sees records already taken, whose drainer checks again itself.
+            const size_t head = head_.load(std::memory_order_relaxed);
+            return ring_[head % ring_.size()].sequence.load(std::memory_order_acquire) == head + 1;
+        }
+    };
+
+    AuditLog::AuditLog(Options options, std::shared_ptr<Executor> executor)
+        : pimpl_{ std::make_shared<Impl>(std::move(options), std::move(executor)) } {}
+
+    AuditLog::~AuditLog() {
+        flush();
+    }
+
+    AuditLog::operator bool() const {
+        return pimpl_->fd_ >= 0;
+    }
+
+    void AuditLog::record(const std::string & session, const std::string & user,
+                          const std::string & command, int result)
+    {
+        auto now = std::chrono::system_clock::now();
+        auto seconds = std::chrono::system_clock::to_time_t(now);
+        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+
+        std::tm utc;
+        gmtime_r(&seconds, &utc);
+        char timestamp[32];
+        auto length = std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+        std::snprintf(timestamp + length, sizeof(timestamp) - length, ".%03dZ", static_cast<int>(millis));
+
+        std::string line = timestamp;
+        line += " session=" + session + " user=" + user + " code=" + std::to_string(result) + " command=";
+        // Keep one record per line.
+        for ( auto c : command ) {
+            if ( c == '\n' ) line += "\\n";
+            else if ( c == '\\' ) line += "\\\\";
+            else line += c;
+        }
+        line += '\n';
+
+        if ( ! pimpl_->push(std::move(line)) ) {
+            ++pimpl_->dropped_;
+            return;
+        }
+        if ( ! pimpl_->draining_.exchange(true, std::memory_order_acquire) ) {
+            auto impl = pimpl_;
+            pimpl_->executor_->execute([impl]{ impl->drain(); });
+        }
+    }
+
+    void AuditLog::flush() {
+        while ( pimpl_->draining_.exchange(true, std::memory_order_acquire) )
+            std::this_thread::yield();
+        pimpl_->drain();
+    }
+
+    unsigned long AuditLog::getDropped() const {
+        return pimpl_->dropped_;
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef CONSOLE_AUDIT_LOG_HEADER_FILE
+#define CONSOLE_AUDIT_LOG_HEADER_FILE
+
+#include <memory>
+#include <string>
+
+#include "Executor.hpp"
+
+namespace CppReadline {
+    /**
+     * @brief This class records executed commands to a log file without blocking the caller.
+     *
+     * Records are pushed into a lock-free ring, which is drained in batches
+     * on an Executor, so that disk latency is never added to a command. If
+     * the ring is full the record is dropped and counted, rather than making
+     * the Console wait.
+     *
+     * Each record is a single line, containing the time, session, user,
+     * return code and the command itself.
+     */
+    class AuditLog {
+        public:
+            enum class Durability {
+                Buffered,   // Batches are written, and left to the OS to persist.
+                Sync        // Every batch is synced to disk before the next one is written.
+            };
+
+            struct Options {
+                std::string path;           // The log file, which is appended to.
+                size_t      maxFileSize;    // The size after which the file is rotated, 0 to never rotate.
+                unsigned    maxFiles;       // How many rotated files (path.1, path.2, ...) are kept.
+                Durability  durability;
+                size_t      capacity;       // How many records the ring can hold.
+            };
+
+            /**
+             * @brief Basic constructor.
+             *
+             * @param options The configuration of the log.
+             * @param executor The Executor on which writes are scheduled, ThreadPool::getDefault() if null.
+             */
+            AuditLog(Options options, std::shared_ptr<Executor> executor);
+
+            /**
+             * @brief Basic destructor.
+             *
+             * Writes all records still in the ring.
+             */
+            ~AuditLog();
+
+            /**
+             * @brief Whether the log file could be opened.
+             */
+            explicit operator bool() const;
+
+            /**
+             * @brief This function adds a record to the log; it never blocks.
+             *
+             * It can be called from any thread.
+             *
+             * @param session An identifier of the session which executed the command.
+             * @param user The user who executed the command.
+             * @param command The command as it was executed.
+             * @param result What the command returned.
+             */
+            void record(const std::string & session, const std::string & user,
+                        const std::string & command, int result);
+
+            /**
+             * @brief This function writes all records currently in the ring, and waits for it.
+             */
+            void flush();
+
+            /**
+             * @brief This function returns how many records were dropped because the ring was full.
+             */
+            unsigned long getDropped() const;
+
+        private:
+            AuditLog(const AuditLog&) = delete;
+            AuditLog(AuditLog&&) = delete;
+            AuditLog& operator = (AuditLog const&) = delete;
+            AuditLog& operator = (AuditLog&&) = delete;
+
+            struct Impl;
+            std::shared_ptr<Impl> pimpl_;
+    };
+}
+
+#endif
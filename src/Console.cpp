@@ -1,15 +1,43 @@
 #include "Console.hpp"
+#include "ScriptReader.hpp"
+#include "Expression.hpp"
+#include "HistoryFile.hpp"
+#include "OutputBuffer.hpp"
 
 #include <iostream>
-#include <fstream>
 #include <functional>
 #include <algorithm>
 #include <iterator>
 #include <sstream>
 #include <unordered_map>
+#include <stdexcept>
+#include <limits>
+#include <regex>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <array>
+#include <chrono>
+#include <thread>
 
+#include <cctype>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <pwd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -17,23 +45,1107 @@ namespace CppReadline {
     namespace {
 
         Console* currentConsole         = nullptr;
-        HISTORY_STATE* emptyHistory     = history_get_history_state();
+        // Readline globals are only touched once some Console actually reads
+        // from the terminal, so batch-only users never pay for them.
+        HISTORY_STATE* emptyHistory     = nullptr;
+        std::once_flag readlineInitialized;
+
+        /**
+         * @brief Classifies bytes for split(): 1 for ASCII whitespace, 2 for other ASCII, 0 for non-ASCII.
+         */
+        struct ByteClasses {
+            unsigned char classes[256];
+
+            ByteClasses() : classes() {
+                for ( int c = 0; c < 0x80; ++c ) classes[c] = 2;
+                for ( char c : { ' ', '\t', '\n', '\v', '\f', '\r' } ) classes[static_cast<unsigned char>(c)] = 1;
+            }
+        };
+        const ByteClasses byteClasses;
+
+        /**
+         * @brief Returns the length of the UTF-8 whitespace character at the start of p, or 0 if there is none.
+         */
+        size_t unicodeSpace(const unsigned char * p, size_t left) {
+            if ( left >= 2 && p[0] == 0xC2 )
+                return ( p[1] == 0x85 || p[1] == 0xA0 ) ? 2 : 0;                  // U+0085, U+00A0
+            if ( left < 3 ) return 0;
+            if ( p[0] == 0xE1 ) return ( p[1] == 0x9A && p[2] == 0x80 ) ? 3 : 0;  // U+1680
+            if ( p[0] == 0xE2 ) {
+                if ( p[1] == 0x80 )                                                 // U+2000-U+200A, U+2028, U+2029, U+202F
+                    return ( p[2] <= 0x8A || p[2] == 0xA8 || p[2] == 0xA9 || p[2] == 0xAF ) && p[2] >= 0x80 ? 3 : 0;
+                return ( p[1] == 0x81 && p[2] == 0x9F ) ? 3 : 0;                   // U+205F
+            }
+            if ( p[0] == 0xE3 ) return ( p[1] == 0x80 && p[2] == 0x80 ) ? 3 : 0;  // U+3000
+            return 0;
+        }
+
+        /**
+         * @brief Returns the length of the UTF-8 character at the start of p, 1 if it is invalid.
+         */
+        size_t characterLength(const unsigned char * p, size_t left) {
+            size_t length = p[0] >= 0xF0 ? 4 : p[0] >= 0xE0 ? 3 : p[0] >= 0xC0 ? 2 : 1;
+            if ( length > left ) return 1;
+            for ( size_t i = 1; i < length; ++i )
+                if ( ( p[i] & 0xC0 ) != 0x80 ) return 1;
+            return length;
+        }
+
+        /**
+         * @brief Splits a command into its whitespace separated elements.
+         *
+         * Whitespace includes the Unicode space characters encoded in UTF-8,
+         * such as non-breaking and ideographic spaces, independently of the
+         * locale. Runs of ASCII characters, which are by far the most common,
+         * are skipped with a single table lookup per byte.
+         */
+        Console::Arguments split(const std::string & command) {
+            Console::Arguments inputs;
+            const auto * p = reinterpret_cast<const unsigned char *>(command.data());
+            const size_t n = command.size();
+            const auto & classes = byteClasses.classes;
+
+            size_t i = 0;
+            while ( i < n ) {
+                // Skip whitespace
+                while ( i < n && classes[p[i]] == 1 ) ++i;
+                if ( i == n ) break;
+                size_t space;
+                if ( classes[p[i]] == 0 && ( space = unicodeSpace(p + i, n - i) ) ) {
+                    i += space;
+                    continue;
+                }
+                // Read an element
+                const size_t start = i;
+                while ( i < n ) {
+                    while ( i < n && classes[p[i]] == 2 ) ++i;
+                    if ( i == n || classes[p[i]] == 1 || unicodeSpace(p + i, n - i) ) break;
+                    i += characterLength(p + i, n - i);
+                }
+                inputs.emplace_back(command, start, i - start);
+            }
+            return inputs;
+        }
+
+        bool writeAll(int fd, const char * data, size_t size) {
+            while ( size > 0 ) {
+                ssize_t r = write(fd, data, size);
+                if ( r < 0 && errno == EINTR ) continue;
+                if ( r <= 0 ) return false;
+                data += r; size -= r;
+            }
+            return true;
+        }
+
+        bool isAnnotation(const std::string & token) {
+            return token.size() > 1 && ( token[0] == '@' || token.compare(0, 6, "after:") == 0 );
+        }
+
+        bool isAnnotated(const std::string & line) {
+            auto tokens = split(line);
+            return ! tokens.empty() && isAnnotation(tokens[0]);
+        }
+
+        /**
+         * @brief Moves the line being edited out of the way, and brings it back once destroyed.
+         *
+         * This allows to print while readline is waiting for input.
+         */
+        class SuspendedLine {
+            public:
+                SuspendedLine() : point_(rl_point), edited_(rl_copy_text(0, rl_end)) {
+                    rl_save_prompt();
+                    rl_replace_line("", 0);
+                    rl_redisplay();
+                }
+                ~SuspendedLine() {
+                    rl_restore_prompt();
+                    rl_replace_line(edited_, 0);
+                    rl_point = point_;
+                    rl_forced_update_display();
+                    free(edited_);
+                }
+
+            private:
+                SuspendedLine(const SuspendedLine&) = delete;
+                SuspendedLine& operator = (SuspendedLine const&) = delete;
+
+                int     point_;
+                char *  edited_;
+        };
+
+        /**
+         * @brief Parses a duration such as "100ms", "2s" or "1.5m".
+         *
+         * @return The duration, or a negative one if it is malformed.
+         */
+        std::chrono::milliseconds parseDuration(const std::string & text) {
+            char * end;
+            double value = std::strtod(text.c_str(), &end);
+            std::string unit(end);
+            double scale = unit == "ms" ? 1.0 : unit == "s" || unit.empty() ? 1000.0 : unit == "m" ? 60000.0 : -1.0;
+            if ( end == text.c_str() || value < 0 || scale < 0 ) return std::chrono::milliseconds(-1);
+            return std::chrono::milliseconds(static_cast<long long>(value * scale));
+        }
+
+        /**
+         * @brief A layer of variables on top of the scope it was created from.
+         *
+         * Lookups fall through to the parent layers, while writes always go
+         * to the innermost one. Creating a scope thus copies nothing, no
+         * matter how large the enclosing environment is, and a layer's map
+         * is only allocated once something is written into it.
+         */
+        class Scope {
+            public:
+                explicit Scope(std::shared_ptr<const Scope> parent = nullptr) :
+                        parent_(std::move(parent)), variables_() {}
+
+                const double * find(const std::string & name) const {
+                    for ( const Scope * scope = this; scope; scope = scope->parent_.get() ) {
+                        if ( ! scope->variables_ ) continue;
+                        auto it = scope->variables_->find(name);
+                        if ( it != scope->variables_->end() ) return &it->second;
+                    }
+                    return nullptr;
+                }
+
+                void set(const std::string & name, double value) {
+                    if ( ! variables_ ) variables_.reset(new std::unordered_map<std::string, double>());
+                    (*variables_)[name] = value;
+                }
+
+            private:
+                std::shared_ptr<const Scope>                                parent_;
+                std::unique_ptr<std::unordered_map<std::string, double>>    variables_;
+        };
+
+        // The variables of the scripts this thread runs, innermost last, with the Console running them.
+        thread_local std::vector<std::pair<const void *, std::shared_ptr<Scope>>> scriptScopes;
+
+        /**
+         * @brief Gives the current thread the variables of a script for as long as it lives.
+         */
+        struct ScriptScope {
+            ScriptScope(const void * console, std::shared_ptr<Scope> scope) {
+                scriptScopes.emplace_back(console, std::move(scope));
+            }
+            ~ScriptScope() { scriptScopes.pop_back(); }
+        };
+
+        /**
+         * @brief Finds the first occurrence of a non-empty pattern in some text, from some position.
+         *
+         * With SSE2, 16 candidate positions are tested at once by comparing
+         * both the first and last character of the pattern, and only the
+         * positions where both match are compared in full.
+         *
+         * @return The position of the occurrence, or std::string::npos.
+         */
+        size_t findNext(const std::string & text, const std::string & pattern, size_t from) {
+            const size_t n = text.size(), k = pattern.size();
+            if ( k > n ) return std::string::npos;
+            const char * data = text.data();
+            size_t i = from;
+#ifdef __SSE2__
+            const __m128i first = _mm_set1_epi8(pattern[0]);
+            const __m128i last  = _mm_set1_epi8(pattern[k - 1]);
+            for ( ; i + k - 1 + 16 <= n; i += 16 ) {
+                const __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                const __m128i blockLast  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + k - 1));
+                unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first),
+                                                                _mm_cmpeq_epi8(blockLast, last)));
+                while ( mask ) {
+                    const unsigned bit = __builtin_ctz(mask);
+                    if ( std::memcmp(data + i + bit + 1, pattern.data() + 1, k > 2 ? k - 2 : 0) == 0 )
+                        return i + bit;
+                    mask &= mask - 1;
+                }
+            }
+#endif
+            for ( ; i + k <= n; ++i )
+                if ( data[i] == pattern[0] && std::memcmp(data + i, pattern.data(), k) == 0 ) return i;
+            return std::string::npos;
+        }
+
+        // How a sharded worker reports each line it executed.
+        struct ShardFrame {
+            uint64_t    line;
+            int64_t     result;
+            uint64_t    size;   // Of the output which follows.
+        };
+
+        // The commands currently being executed on this thread, outermost first.
+        thread_local std::vector<std::string> callChain;
+
+        // Where std::cout writes when it is not redirected, taken before any Console exists.
+        std::streambuf * const standardOutput = std::cout.rdbuf();
+
+        // The Console whose output buffer this thread is printing to, if any.
+        thread_local const void * coalescing = nullptr;
+
+        // Whether the last command dispatched by this thread was moved to the
+        // background, so that it is audited once it finishes instead.
+        thread_local bool deferred = false;
+
+        // How long, in milliseconds, the user must stop typing before we complete speculatively.
+        constexpr int typingPause = 150;
+
+        // How many worker processes "run --shards" may fork at most.
+        constexpr unsigned long maxShards = 64;
+
+        /**
+         * @brief A snapshot of command names which allows fast substring completion.
+         *
+         * Every suffix of every command name is kept sorted, so that finding
+         * all commands containing some text becomes a prefix search over the
+         * suffixes, rather than a scan over every registered command.
+         */
+        struct CompletionIndex {
+            using Suffix = std::pair<size_t, size_t>; // (name index, offset)
+
+            unsigned long               version;
+            std::vector<std::string>    names;
+            std::vector<Suffix>         suffixes;
+
+            CompletionIndex(unsigned long v, std::vector<std::string> n) :
+                    version(v), names(std::move(n)), suffixes()
+            {
+                for ( size_t i = 0; i < names.size(); ++i )
+                    for ( size_t j = 0; j < names[i].size(); ++j )
+                        suffixes.emplace_back(i, j);
+
+                std::sort(begin(suffixes), end(suffixes), [this](const Suffix & lhs, const Suffix & rhs) {
+                    return names[lhs.first].compare(lhs.second, std::string::npos,
+                                                    names[rhs.first], rhs.second, std::string::npos) < 0;
+                });
+            }
+
+            std::vector<std::string> find(const std::string & text) const {
+                if ( text.empty() ) return names;
+
+                auto first = std::lower_bound(begin(suffixes), end(suffixes), text,
+                    [this](const Suffix & suffix, const std::string & t) {
+                        return names[suffix.first].compare(suffix.second, std::string::npos, t) < 0;
+                    });
+
+                std::vector<bool> found(names.size(), false);
+                for ( ; first != end(suffixes); ++first ) {
+                    if ( names[first->first].compare(first->second, text.size(), text) != 0 ) break;
+                    found[first->first] = true;
+                }
+
+                std::vector<std::string> matches;
+                for ( size_t i = 0; i < names.size(); ++i )
+                    if ( found[i] ) matches.push_back(names[i]);
+                return matches;
+            }
+        };
+
+        /**
+         * @brief A lock-free token bucket, implemented as a generic cell rate algorithm.
+         *
+         * Rather than counting tokens, it keeps the theoretical arrival time
+         * of the next call: a call is allowed as long as that time is not
+         * further in the future than what the burst allows. This makes the
+         * whole state a single atomic.
+         */
+        class RateLimiter {
+            public:
+                using Clock = std::chrono::steady_clock;
+
+                explicit RateLimiter(const Console::RateLimit & limit) :
+                        policy_(limit.policy),
+                        interval_(static_cast<int64_t>(1e9 / limit.rate)),
+                        tolerance_(interval_ * (limit.burst > 0 ? limit.burst - 1 : 0)),
+                        arrival_(0), allowed_(0), delayed_(0), rejected_(0) {}
+
+                /**
+                 * @brief Takes a token, waiting for it if the policy allows it.
+                 *
+                 * @return Whether the call can go ahead.
+                 */
+                bool acquire() {
+                    const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            Clock::now().time_since_epoch()).count();
+
+                    int64_t arrival = arrival_.load(std::memory_order_relaxed), wait;
+                    do {
+                        const int64_t base = std::max(arrival, now);
+                        wait = base - now - tolerance_;
+                        if ( wait > 0 && policy_ == Console::RateLimit::Policy::Fail ) {
+                            ++rejected_;
+                            return false;
+                        }
+                    } while ( ! arrival_.compare_exchange_weak(arrival, std::max(arrival, now) + interval_) );
+
+                    if ( wait > 0 ) {
+                        ++delayed_;
+                        std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+                    }
+                    ++allowed_;
+                    return true;
+                }
+
+                Console::RateLimitStats getStats() const {
+                    return Console::RateLimitStats{allowed_, delayed_, rejected_};
+                }
+
+            private:
+                const Console::RateLimit::Policy    policy_;
+                const int64_t                       interval_, tolerance_;
+                std::atomic<int64_t>                arrival_;
+                std::atomic<unsigned long>          allowed_, delayed_, rejected_;
+        };
+
+        /**
+         * @brief Counts latencies into a Console::LatencyHistogram.
+         *
+         * Only one thread records, but any thread can read.
+         */
+        class LatencyRecorder {
+            public:
+                LatencyRecorder() : buckets_(), count_(0), total_(0), max_(0) {}
+
+                void record(std::chrono::steady_clock::duration latency) {
+                    const unsigned long us = std::max<long long>(
+                            std::chrono::duration_cast<std::chrono::microseconds>(latency).count(), 0);
+                    size_t bucket = 0;
+                    while ( bucket + 1 < Buckets && (us >> bucket) > 0 ) ++bucket;
+
+                    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+                    count_.fetch_add(1, std::memory_order_relaxed);
+                    total_.fetch_add(us, std::memory_order_relaxed);
+                    if ( us > max_.load(std::memory_order_relaxed) ) max_.store(us, std::memory_order_relaxed);
+                }
+
+                Console::LatencyHistogram get() const {
+                    Console::LatencyHistogram histogram{{}, count_, std::chrono::microseconds(total_),
+                                                        std::chrono::microseconds(max_)};
+                    for ( auto & bucket : buckets_ ) histogram.buckets.push_back(bucket);
+                    return histogram;
+                }
+
+            private:
+                // Up to about 16 seconds.
+                static constexpr size_t Buckets = 25;
+
+                std::array<std::atomic<unsigned long>, Buckets> buckets_;
+                std::atomic<unsigned long>                      count_, total_, max_;
+        };
 
     }  /* namespace  */
 
     struct Console::Impl {
-        using RegisteredCommands = std::unordered_map<std::string,Console::CommandFunction>;
+        // Each command is either synchronous or asynchronous; only one function is set.
+        struct Command {
+            Console::CommandFunction        function;
+            Console::AsyncCommandFunction   asyncFunction;
+            // Optional, shared so that the atomics never move.
+            std::shared_ptr<RateLimiter>    limiter;
+            // Optional, checked before calling the command.
+            std::shared_ptr<const Console::ArgumentSchema> schema;
+            // Optional, shared with the completion queries running in the background.
+            std::shared_ptr<const Console::ArgumentCompleter> completer;
+
+            Command() : function(), asyncFunction(), limiter(), schema(), completer() {}
+            Command(Console::CommandFunction f, Console::AsyncCommandFunction af,
+                    std::shared_ptr<RateLimiter> l = nullptr,
+                    std::shared_ptr<const Console::ArgumentSchema> sc = nullptr) :
+                    function(std::move(f)), asyncFunction(std::move(af)),
+                    limiter(std::move(l)), schema(std::move(sc)), completer() {}
+        };
+        using RegisteredCommands = std::unordered_map<std::string,Command>;
+
+        // An asynchronous command which is still running in the background.
+        struct Job {
+            unsigned            id;
+            std::string         command;
+            std::future<int>    result;
+        };
+
+        // Completion index, built in the background once registration settles.
+        // The state is shared with the building task, so that the Console
+        // never needs to wait for it.
+        struct IndexState {
+            std::mutex                              mutex;
+            std::shared_ptr<const CompletionIndex>  index;
+            std::atomic<bool>                       building{false};
 
-        ::std::string       greeting_;
-        // These are hardcoded commands. They do not do anything and are catched manually in the executeCommand function.
-        RegisteredCommands  commands_;
+            IndexState() : mutex(), index() {}
+        };
+
+        // A context: a command table with its own prompt and completion index.
+        // Entering and exiting contexts only changes which one is active.
+        struct Registry {
+            std::string                 name;
+            ::std::string               greeting;
+            RegisteredCommands          commands;
+            unsigned long               version = 0;
+            std::shared_ptr<IndexState> indexState;
+
+            Registry(std::string n, std::string g) :
+                    name(std::move(n)), greeting(std::move(g)), commands(),
+                    indexState(std::make_shared<IndexState>()) {}
+
+            void add(const std::string & s, Command c) {
+                commands[s] = std::move(c);
+                ++version;
+            }
+        };
+
+        Registry                                                    root_;
+        std::unordered_map<std::string, std::unique_ptr<Registry>>  contexts_;
+        // The contexts entered so far, the last being the active one.
+        std::vector<Registry*>                                      stack_;
+        Registry *                                                  active_;
         HISTORY_STATE*      history_    = nullptr;
 
-        Impl(::std::string const& greeting) : greeting_(greeting), commands_() {}
+        // Where all asynchronous work is scheduled; the default pool if null.
+        std::shared_ptr<Executor>   executor_;
+
+        // Where executed commands are recorded, if anywhere.
+        std::shared_ptr<AuditLog>   audit_;
+        std::string                 session_;
+        std::string                 user_;
+
+        // Named pipe from which commands can be injected, and where their output goes.
+        int                 controlFd_ = -1;
+        int                 controlKeepAlive_ = -1;
+        std::string         replyPath_;
+        std::string         controlBuffer_;
+        bool                controlQuit_ = false;
+
+        // Variables of the expr command, and its expressions compiled so far.
+        std::shared_ptr<Scope>                                                      scope_;
+        std::unordered_map<std::string, std::shared_ptr<const Expression>>          expressions_;
+
+        // Guards the state of built-in commands, as annotated scripts run them concurrently.
+        std::mutex              stateMutex_;
+        // How many annotated scripts are running; contexts cannot change meanwhile.
+        std::atomic<unsigned>   graphs_{0};
+
+        // A contiguous copy of the history, which is searched by the history command.
+        std::string             historyText_;
+        std::vector<size_t>     historyOffsets_;   // Where each entry starts in historyText_.
+        int                     historyBase_ = 0;
+
+        // Callbacks to run at some point in time, from the thread running the Console.
+        using Clock = std::chrono::steady_clock;
+        std::mutex                                              timersMutex_;
+        std::multimap<Clock::time_point, std::function<void()>> timers_;
+
+        // How deeply commands can call other commands.
+        unsigned            maxNestingDepth_ = 64;
+
+        // Whether commands are coming straight from the user via readLine().
+        bool                interactive_ = false;
+        std::vector<Job>    jobs_;
+        unsigned            nextJobId_ = 1;
+
+        // Matches of the current completion, when served from the index.
+        std::vector<std::string>        completionMatches_;
+
+        // The long completion list being shown, and where its next page starts.
+        struct CompletionPage {
+            int             count = 0;
+            std::string     first, last;
+            int             next = 0;
+
+            CompletionPage() : first(), last() {}
+        };
+        CompletionPage      completionPage_;
+
+        // A completion query started before Tab was pressed, for the line up to the cursor.
+        struct Speculation {
+            std::string                                     key;
+            std::shared_future<std::vector<std::string>>    result;
+            // Set by whoever gets to the query first: the task starting it, or cancelling it.
+            std::shared_ptr<std::atomic<bool>>              claimed;
+
+            Speculation() : key(), result(), claimed() {}
+        };
+        Speculation         speculation_;
+
+        // Editing latency, measured only when asked to.
+        std::atomic<bool>   trackLatency_{false};
+        Clock::time_point   keyReceived_;
+        bool                keyPending_ = false;    // Whether a key is waiting to be shown.
+        LatencyRecorder     keystrokeLatency_, completionLatency_;
+
+        // What commands print is coalesced here, rather than written a line at a time.
+        OutputBuffer        output_;
+        std::ostream        out_;       // Writes to output_.
+        std::atomic<bool>   outputClaimed_{false};
+
+        Impl(::std::string const& greeting, std::shared_ptr<Executor> executor) :
+                root_("", greeting), contexts_(), stack_(), active_(&root_), executor_(std::move(executor)),
+                audit_(), session_(), user_(), replyPath_(), controlBuffer_(),
+                scope_(std::make_shared<Scope>()), expressions_(), stateMutex_(),
+                historyText_(), historyOffsets_(), timersMutex_(), timers_(), jobs_(), completionMatches_(), completionPage_(), speculation_(),
+                keyReceived_(), keystrokeLatency_(), completionLatency_(),
+                output_(STDOUT_FILENO), out_(&output_) {}
         ~Impl() {
+            closeControlChannel();
             free(history_);
         }
 
+        void closeControlChannel() {
+            if ( controlFd_ >= 0 ) close(controlFd_);
+            if ( controlKeepAlive_ >= 0 ) close(controlKeepAlive_);
+            controlFd_ = controlKeepAlive_ = -1;
+            controlBuffer_.clear();
+        }
+
+        /**
+         * @brief Sends the output of a control command to whoever is listening on the reply pipe.
+         *
+         * Nobody listening, or a listener too slow to take it all, simply
+         * loses the output: the Console never waits for the reader.
+         */
+        void reply(const std::string & output) {
+            if ( output.empty() || replyPath_.empty() ) return;
+
+            int fd = open(replyPath_.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if ( fd < 0 ) return;
+            size_t written = 0;
+            while ( written < output.size() ) {
+                ssize_t r = write(fd, output.data() + written, output.size() - written);
+                if ( r < 0 && errno == EINTR ) continue;
+                if ( r <= 0 ) break;
+                written += r;
+            }
+            close(fd);
+        }
+
+        Executor & executor() {
+            if ( ! executor_ ) executor_ = ThreadPool::getDefault();
+            return *executor_;
+        }
+
+        /**
+         * @brief Starts building the completion index if the current one is missing or stale.
+         */
+        void prewarmCompletionIndex() {
+            auto & state = active_->indexState;
+            if ( state->building ) return;
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if ( state->index && state->index->version == active_->version ) return;
+            }
+
+            std::vector<std::string> names;
+            names.reserve(active_->commands.size());
+            for ( auto & pair : active_->commands ) names.push_back(pair.first);
+
+            state->building = true;
+            // C++11 lambdas cannot move-capture, so we move through a shared_ptr.
+            auto snapshot = std::make_shared<std::vector<std::string>>(std::move(names));
+            auto shared = state;
+            auto version = active_->version;
+            executor().execute([shared, snapshot, version]() {
+                auto index = std::make_shared<const CompletionIndex>(version, std::move(*snapshot));
+                {
+                    std::lock_guard<std::mutex> lock(shared->mutex);
+                    shared->index = std::move(index);
+                }
+                shared->building = false;
+            });
+        }
+
+        /**
+         * @brief Makes a context the active one.
+         */
+        int enter(const Console::Arguments & input) {
+            if ( graphs_ ) return contextLocked();
+            if ( input.size() != 2 ) {
+                output() << "Usage: " << input[0] << " context\n";
+                return Console::ReturnCode::Error;
+            }
+            auto it = contexts_.find(input[1]);
+            if ( it == end(contexts_) ) {
+                output() << "Context '" << input[1] << "' not found.\n";
+                return Console::ReturnCode::Error;
+            }
+            stack_.push_back(it->second.get());
+            active_ = stack_.back();
+            return Console::ReturnCode::Ok;
+        }
+
+        int contextLocked() {
+            output() << "Contexts cannot change while an annotated script runs.\n";
+            return Console::ReturnCode::Error;
+        }
+
+        /**
+         * @brief Goes back to the context which was active before the current one.
+         */
+        int leave() {
+            if ( graphs_ ) return contextLocked();
+            stack_.pop_back();
+            active_ = stack_.empty() ? &root_ : stack_.back();
+            return Console::ReturnCode::Ok;
+        }
+
+        /**
+         * @brief Runs an already split command.
+         */
+        int dispatch(const Console::Arguments & inputs) {
+            if ( callChain.size() >= maxNestingDepth_ ) {
+                auto & out = output();
+                out << "Maximum nesting depth (" << maxNestingDepth_ << ") exceeded: ";
+                for ( auto & name : callChain ) out << name << " -> ";
+                out << inputs[0] << '\n';
+                return Console::ReturnCode::Error;
+            }
+            callChain.push_back(inputs[0]);
+            struct Pop {
+                ~Pop() { callChain.pop_back(); }
+            } pop;
+
+            RegisteredCommands::iterator it;
+            if ( ( it = active_->commands.find(inputs[0]) ) != end(active_->commands) ) {
+                auto & c = it->second;
+                if ( c.schema && ! validate(inputs, *c.schema) ) return Console::ReturnCode::Error;
+                if ( c.limiter && ! c.limiter->acquire() ) {
+                    output() << "Command '" << inputs[0] << "' is rate limited, try again later.\n";
+                    return Console::ReturnCode::Error;
+                }
+                // Commands may print to std::cout, which must not overtake what we
+                // buffered, nor be overtaken by what we buffer afterwards, even
+                // when it is not synchronized with stdio.
+                struct Flush {
+                    bool coalesced;
+                    ~Flush() { if ( coalesced ) std::cout.flush(); }
+                } flush{coalescing == this};
+                if ( flush.coalesced ) output_.flush();
+                if ( c.function ) return static_cast<int>(c.function(inputs));
+                return awaitOrDefer(inputs, c.asyncFunction(inputs));
+            }
+
+            output() << "Command '" << inputs[0] << "' not found.\n";
+            return Console::ReturnCode::Error;
+        }
+
+        /**
+         * @brief Checks the arguments of a command against its schema, reporting any problem.
+         */
+        bool validate(const Console::Arguments & inputs, const Console::ArgumentSchema & schema) {
+            if ( inputs.size() != schema.size() + 1 ) {
+                auto & out = output();
+                out << "Usage: " << inputs[0];
+                for ( auto & argument : schema ) out << " <" << argument.describe() << '>';
+                out << '\n';
+                return false;
+            }
+            for ( size_t i = 0; i < schema.size(); ++i ) {
+                if ( ! schema[i].check(inputs[i + 1]) ) {
+                    output() << "Invalid argument " << i + 1 << " '" << inputs[i + 1] << "' for '" << inputs[0]
+                             << "': expected " << schema[i].describe() << ".\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief Returns the variables of the script this thread is running, or ours outside of scripts.
+         */
+        std::shared_ptr<Scope> currentScope() const {
+            for ( auto it = scriptScopes.rbegin(); it != scriptScopes.rend(); ++it )
+                if ( it->first == this ) return it->second;
+            return scope_;
+        }
+
+        /**
+         * @brief Implements the expr command.
+         */
+        int evaluate(const Console::Arguments & input) {
+            if ( input.size() < 2 ) {
+                output() << "Usage: " << input[0] << " [variable =] expression\n";
+                return Console::ReturnCode::Error;
+            }
+            std::string text, target;
+            for ( size_t i = 1; i < input.size(); ++i ) text += input[i] + ' ';
+
+            auto equal = text.find('=');
+            if ( equal != std::string::npos ) {
+                std::istringstream iss(text.substr(0, equal));
+                if ( ! (iss >> target) || ! (iss >> std::ws).eof() ||
+                     ! ( std::isalpha(static_cast<unsigned char>(target[0])) || target[0] == '_' ) ||
+                     ! std::all_of(begin(target), end(target), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }) )
+                {
+                    output() << "Invalid variable name.\n";
+                    return Console::ReturnCode::Error;
+                }
+                text.erase(0, equal + 1);
+            }
+
+            std::lock_guard<std::mutex> lock(stateMutex_);
+            auto scope = currentScope();
+
+            // Expressions are only compiled the first time they are seen.
+            auto it = expressions_.find(text);
+            if ( it == end(expressions_) ) {
+                if ( expressions_.size() >= 4096 ) expressions_.clear();
+                try {
+                    it = expressions_.emplace(text, std::make_shared<const Expression>(text)).first;
+                } catch ( std::invalid_argument & e ) {
+                    output() << "Invalid expression: " << e.what() << ".\n";
+                    return Console::ReturnCode::Error;
+                }
+            }
+            auto & expression = *it->second;
+
+            std::vector<double> values;
+            values.reserve(expression.getVariables().size());
+            for ( auto & name : expression.getVariables() ) {
+                auto variable = scope->find(name);
+                if ( ! variable ) {
+                    output() << "Unknown variable '" << name << "'.\n";
+                    return Console::ReturnCode::Error;
+                }
+                values.push_back(*variable);
+            }
+
+            double result = expression.evaluate(values);
+            auto & out = output();
+            if ( ! target.empty() ) {
+                scope->set(target, result);
+                out << target << " = ";
+            }
+            out << result << '\n';
+            return Console::ReturnCode::Ok;
+        }
+
+        /**
+         * @brief Implements the history command. The history of this Console must be the one loaded, under stateMutex_.
+         */
+        int listHistory(const Console::Arguments & input) {
+            std::string pattern;
+            unsigned long limit = std::numeric_limits<unsigned long>::max();
+            for ( size_t i = 1; i < input.size(); ++i ) {
+                try {
+                    if ( input[i] == "-n" && i + 1 < input.size() ) { limit = std::stoul(input[++i]); continue; }
+                } catch ( std::exception & ) {}
+                if ( input[i] == "-n" || ! pattern.empty() ) {
+                    output() << "Usage: " << input[0] << " [pattern] [-n count]\n";
+                    return Console::ReturnCode::Error;
+                }
+                pattern = input[i];
+            }
+
+            // The copy is only extended with new entries, unless the history was changed otherwise.
+            HIST_ENTRY ** list = history_list();
+            const size_t length = history_length;
+            if ( historyBase_ != history_base || historyOffsets_.size() > length ) {
+                historyText_.clear();
+                historyOffsets_.clear();
+                historyBase_ = history_base;
+            }
+            for ( size_t i = historyOffsets_.size(); i < length; ++i ) {
+                historyOffsets_.push_back(historyText_.size());
+                historyText_ += list[i]->line;
+                historyText_ += '\n';
+            }
+
+            std::vector<size_t> matches;
+            if ( pattern.empty() ) {
+                for ( size_t i = 0; i < length; ++i ) matches.push_back(i);
+            } else {
+                size_t position = 0;
+                while ( ( position = findNext(historyText_, pattern, position) ) != std::string::npos ) {
+                    // Find the entry of the match, and continue from the next one.
+                    size_t entry = std::upper_bound(begin(historyOffsets_), end(historyOffsets_), position)
+                                   - begin(historyOffsets_) - 1;
+                    matches.push_back(entry);
+                    if ( entry + 1 >= length ) break;
+                    position = historyOffsets_[entry + 1];
+                }
+            }
+
+            std::string text;
+            for ( size_t m = matches.size() > limit ? matches.size() - limit : 0; m < matches.size(); ++m ) {
+                auto i = matches[m];
+                auto number = std::to_string(historyBase_ + i);
+                text.append(number.size() < 5 ? 5 - number.size() : 0, ' ');
+                text += number + "  ";
+                text.append(historyText_, historyOffsets_[i], ( i + 1 < length ? historyOffsets_[i + 1] : historyText_.size() ) - historyOffsets_[i]);
+            }
+            output() << text;
+            return Console::ReturnCode::Ok;
+        }
+
+        /**
+         * @brief Returns where commands should print.
+         *
+         * This is output_ while this thread holds it, and std::cout otherwise,
+         * or whenever std::cout has been redirected since.
+         */
+        std::ostream & output() {
+            return coalescing == this && std::cout.rdbuf() == standardOutput ? out_ : std::cout;
+        }
+
+        /**
+         * @brief Lets the current thread print to output_ while it lives.
+         *
+         * Only one thread at a time gets the buffer, and only if std::cout
+         * writes to the standard output, as output_ writes there directly.
+         * std::cout itself is never touched, so other threads can keep
+         * printing to it.
+         */
+        class CoalescedOutput {
+            public:
+                explicit CoalescedOutput(Impl & impl) : impl_(impl), active_(false) {
+                    if ( coalescing || std::cout.rdbuf() != standardOutput ) return;
+                    if ( impl_.outputClaimed_.exchange(true) ) return;
+                    // Whatever std::cout holds was printed before anything we buffer.
+                    std::cout.flush();
+                    coalescing = &impl_;
+                    active_ = true;
+                }
+                ~CoalescedOutput() {
+                    if ( ! active_ ) return;
+                    coalescing = nullptr;
+                    impl_.output_.flush();
+                    impl_.outputClaimed_ = false;
+                }
+                CoalescedOutput(const CoalescedOutput &) = delete;
+                CoalescedOutput & operator=(const CoalescedOutput &) = delete;
+
+            private:
+                Impl & impl_;
+                bool active_;
+        };
+
+        /**
+         * @brief Stops the current thread from buffering while other threads may print.
+         *
+         * Work running elsewhere prints straight to std::cout, so we write
+         * out what we have and stop holding output back, to keep it in order.
+         */
+        class ReleasedOutput {
+            public:
+                explicit ReleasedOutput(Impl & impl) : impl_(impl), released_(coalescing == &impl) {
+                    if ( ! released_ ) return;
+                    impl_.output_.flush();
+                    coalescing = nullptr;
+                }
+                ~ReleasedOutput() {
+                    if ( released_ ) coalescing = &impl_;
+                }
+                ReleasedOutput(const ReleasedOutput &) = delete;
+                ReleasedOutput & operator=(const ReleasedOutput &) = delete;
+
+            private:
+                Impl & impl_;
+                bool released_;
+        };
+
+        /**
+         * @brief Returns whether running the command may wait for other work on the Executor.
+         *
+         * Asynchronous commands are waited for outside the prompt, and
+         * scripts may run such commands.
+         */
+        bool waitsForExecutor(const std::string & name) {
+            auto it = active_->commands.find(name);
+            if ( it == end(active_->commands) ) return false;
+            return ! it->second.function || name == "run" || name == "source";
+        }
+
+        /**
+         * @brief Waits for the result of an asynchronous command, or moves it to the background when interactive.
+         */
+        int awaitOrDefer(const Console::Arguments & input, std::future<int> result) {
+            if ( ! result.valid() ) return Console::ReturnCode::Error;
+
+            // Commands called by other commands always need their result.
+            if ( interactive_ && callChain.size() == 1 && result.wait_for(std::chrono::seconds(0)) != std::future_status::ready ) {
+                std::string command;
+                for ( auto & arg : input ) command += (command.empty() ? "" : " ") + arg;
+
+                output() << "[" << nextJobId_ << "] '" << command << "' running in background.\n";
+                jobs_.push_back(Job{nextJobId_++, std::move(command), std::move(result)});
+                deferred = true;
+                return Console::ReturnCode::Ok;
+            }
+            // Timers may be what completes the result, so we keep running them.
+            ReleasedOutput released(*this);
+            Clock::time_point next;
+            while ( nextTimer(next) && result.wait_until(next) != std::future_status::ready )
+                runDueTimers();
+            return result.get();
+        }
+
+        void addTimer(Clock::duration delay, std::function<void()> callback) {
+            std::lock_guard<std::mutex> lock(timersMutex_);
+            timers_.emplace(Clock::now() + delay, std::move(callback));
+        }
+
+        bool nextTimer(Clock::time_point & next) {
+            std::lock_guard<std::mutex> lock(timersMutex_);
+            if ( timers_.empty() ) return false;
+            next = timers_.begin()->first;
+            return true;
+        }
+
+        /**
+         * @brief Returns how many milliseconds until the next timer, or -1 if there are none.
+         */
+        int nextTimerTimeout() {
+            Clock::time_point next;
+            if ( ! nextTimer(next) ) return -1;
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count();
+            // Round up, so that we do not wake up just before the deadline.
+            return wait < 0 ? 0 : static_cast<int>(wait) + 1;
+        }
+
+        void runDueTimers() {
+            while ( true ) {
+                std::function<void()> callback;
+                {
+                    std::lock_guard<std::mutex> lock(timersMutex_);
+                    if ( timers_.empty() || timers_.begin()->first > Clock::now() ) return;
+                    callback = std::move(timers_.begin()->second);
+                    timers_.erase(timers_.begin());
+                }
+                callback();
+            }
+        }
+
+        /**
+         * @brief Reports all background commands which have completed since the last prompt.
+         */
+        void reportFinishedJobs() {
+            auto finished = std::stable_partition(begin(jobs_), end(jobs_), [](Job & job) {
+                return job.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+            });
+            auto & out = output();
+            for ( auto it = finished; it != end(jobs_); ++it ) {
+                out << "[" << it->id << "] '" << it->command << "' ";
+                int result = Console::ReturnCode::Error;
+                try {
+                    result = it->result.get();
+                    out << "finished with code " << result << ".\n";
+                } catch ( std::exception & e ) {
+                    out << "failed: " << e.what() << "\n";
+                } catch ( ... ) {
+                    out << "failed.\n";
+                }
+                if ( audit_ ) audit_->record(session_, user_, it->command, result);
+            }
+            jobs_.erase(finished, end(jobs_));
+        }
+
+        /**
+         * @brief Finds the completer for the argument being typed, if any.
+         *
+         * @param line The line up to the cursor.
+         * @param arguments Set to the words before the one being completed.
+         * @param word Set to the beginning of the word being completed.
+         */
+        std::shared_ptr<const Console::ArgumentCompleter> findCompleter(const std::string & line,
+                Console::Arguments & arguments, std::string & word) {
+            // Words are delimited as readline does, so that we agree on what is being completed.
+            const char * breaks = rl_completer_word_break_characters ? rl_completer_word_break_characters
+                                                                     : rl_basic_word_break_characters;
+            const auto start = line.find_last_of(breaks);
+            if ( start == std::string::npos ) return nullptr;
+
+            arguments = split(line.substr(0, start));
+            if ( arguments.empty() ) return nullptr;
+            auto it = active_->commands.find(arguments[0]);
+            if ( it == end(active_->commands) ) return nullptr;
+
+            word = line.substr(start + 1);
+            return it->second.completer;
+        }
+
+        void cancelSpeculation() {
+            if ( speculation_.claimed ) *speculation_.claimed = true;
+            speculation_ = Speculation();
+        }
+
+        /**
+         * @brief Returns how long to wait for a pause in typing before speculating, or -1 if there is nothing to speculate.
+         */
+        int speculationTimeout() {
+            const std::string line(rl_line_buffer, rl_point);
+            if ( speculation_.result.valid() && speculation_.key == line ) return -1;
+            // The word has changed, so whatever we were computing is useless.
+            cancelSpeculation();
+
+            Console::Arguments arguments;
+            std::string word;
+            return findCompleter(line, arguments, word) ? typingPause : -1;
+        }
+
+        /**
+         * @brief Starts completing the argument at the cursor on the Executor.
+         */
+        void speculate() {
+            const std::string line(rl_line_buffer, rl_point);
+            Console::Arguments arguments;
+            std::string word;
+            auto completer = findCompleter(line, arguments, word);
+            if ( ! completer ) return;
+
+            auto claimed = std::make_shared<std::atomic<bool>>(false);
+            auto result = std::make_shared<std::promise<std::vector<std::string>>>();
+            speculation_.key = line;
+            speculation_.result = result->get_future().share();
+            speculation_.claimed = claimed;
+
+            executor().execute([completer, arguments, word, claimed, result]{
+                try {
+                    // Queries cancelled before starting are skipped.
+                    result->set_value(claimed->exchange(true) ? std::vector<std::string>() : (*completer)(arguments, word));
+                } catch ( ... ) {
+                    result->set_exception(std::current_exception());
+                }
+            });
+        }
+
+        /**
+         * @brief Sets completionMatches_ to the candidates for the argument being completed.
+         *
+         * A speculative query for the same line is waited for if it has
+         * already started; one still queued is cancelled and run here
+         * instead, so Tab never waits behind other work on the Executor.
+         *
+         * @return Whether the command has a completer.
+         */
+        bool completeArgument(const std::string & line) {
+            completionMatches_.clear();
+            try {
+                if ( speculation_.result.valid() && speculation_.key == line && speculation_.claimed->exchange(true) ) {
+                    completionMatches_ = speculation_.result.get();
+                    return true;
+                }
+                cancelSpeculation();
+
+                Console::Arguments arguments;
+                std::string word;
+                auto completer = findCompleter(line, arguments, word);
+                if ( ! completer ) return false;
+                completionMatches_ = (*completer)(arguments, word);
+            } catch ( ... ) {
+                // A failing completer simply has no candidates.
+            }
+            return true;
+        }
+
+        /**
+         * @brief Returns the completion index, if it is up to date with the registered commands.
+         */
+        std::shared_ptr<const CompletionIndex> readyCompletionIndex() {
+            std::lock_guard<std::mutex> lock(active_->indexState->mutex);
+            auto & index = active_->indexState->index;
+            if ( index && index->version == active_->version ) return index;
+            return nullptr;
+        }
+
         Impl(Impl const&) = delete;
         Impl(Impl&&) = delete;
         Impl& operator = (Impl const&) = delete;
@@ -43,43 +1155,194 @@ namespace CppReadline {
     // Here we set default commands, they do nothing since we quit with them
     // Quitting behaviour is hardcoded in readLine()
     Console::Console(std::string const& greeting)
-        : pimpl_{ new Impl{ greeting } }
-    {
-        // Init readline basics
-        rl_attempted_completion_function = &Console::getCommandCompletions;
+        : Console(greeting, nullptr) {}
 
+    Console::Console(std::string const& greeting, std::shared_ptr<Executor> executor)
+        : pimpl_{ new Impl{ greeting, std::move(executor) } }
+    {
         // These are default hardcoded commands.
         // Help command lists available commands.
-        pimpl_->commands_["help"] = [this](const Arguments &){
+        registerCommand("help", [this](const Arguments &){
             auto commands = getRegisteredCommands();
-            std::cout << "Available commands are:\n";
-            for ( auto & command : commands ) std::cout << "\t" << command << "\n";
+            auto & out = pimpl_->output();
+            out << "Available commands are:\n";
+            for ( auto & command : commands ) out << "\t" << command << "\n";
             return ReturnCode::Ok;
-        };
-        // Run command executes all commands in an external file.
-        pimpl_->commands_["run"] =  [this](const Arguments & input) {
-            if ( input.size() < 2 ) { std::cout << "Usage: " << input[0] << " script_filename\n"; return 1; }
+        });
+        // Run command executes all commands in an external file, in a new variable scope.
+        // With --shards, lines are split among worker processes by the hash of an argument.
+        registerCommand("run", [this](const Arguments & input) {
+            std::string filename;
+            unsigned long shards = 0, key = 1;
+            bool valid = true;
+            for ( size_t i = 1; i < input.size() && valid; ++i ) {
+                try {
+                    if ( input[i] == "--shards" && i + 1 < input.size() ) {
+                        shards = std::stoul(input[++i]);
+                        valid = shards > 0 && shards <= maxShards;
+                    }
+                    else if ( input[i] == "--key" && i + 1 < input.size() ) key = std::stoul(input[++i]);
+                    else if ( filename.empty() ) filename = input[i];
+                    else valid = false;
+                } catch ( std::exception & ) {
+                    valid = false;
+                }
+            }
+            if ( ! valid || filename.empty() ) {
+                pimpl_->output() << "Usage: " << input[0] << " [--shards N [--key argument_position]] script_filename\n"
+                                 << "N must be between 1 and " << maxShards << ".\n";
+                return 1;
+            }
+            if ( shards > 0 ) return executeFileSharded(filename, shards, key);
+
+            // The script gets its own variables, on top of ours.
+            ScriptScope scope(pimpl_.get(), std::make_shared<Scope>(pimpl_->currentScope()));
+            return executeFile(filename);
+        });
+        // Source command executes all commands in an external file, sharing our variables.
+        registerCommand("source", [this](const Arguments & input) {
+            if ( input.size() != 2 ) { pimpl_->output() << "Usage: " << input[0] << " script_filename\n"; return 1; }
             return executeFile(input[1]);
-        };
+        });
+        // Expr command evaluates arithmetic expressions, and can store their result in variables.
+        registerCommand("expr", [this](const Arguments & input) {
+            return pimpl_->evaluate(input);
+        });
+        // Retry command repeats a failing command, waiting longer each time.
+        registerAsyncCommand("retry", [this](const Arguments & input) {
+            return retry(input);
+        });
+        // History command lists, and optionally filters, the history of this Console.
+        registerCommand("history", [this](const Arguments & input) {
+            // Scripts may run lines concurrently, and readline has a single history.
+            std::lock_guard<std::mutex> lock(pimpl_->stateMutex_);
+            reserveConsole();
+            return pimpl_->listHistory(input);
+        });
+        // Enter command switches to a context registered with registerContext.
+        registerCommand("enter", [this](const Arguments & input) {
+            return pimpl_->enter(input);
+        });
         // Quit and Exit simply terminate the console.
-        pimpl_->commands_["quit"] = [this](const Arguments &) {
+        registerCommand("quit", [](const Arguments &) {
             return ReturnCode::Quit;
-        };
+        });
 
-        pimpl_->commands_["exit"] = [this](const Arguments &) {
+        registerCommand("exit", [](const Arguments &) {
             return ReturnCode::Quit;
-        };
+        });
     }
 
     Console::~Console() = default;
 
     void Console::registerCommand(const std::string & s, CommandFunction f) {
-        pimpl_->commands_[s] = f;
+        pimpl_->root_.add(s, Impl::Command{f, nullptr});
+    }
+
+    void Console::registerCommand(const std::string & s, CommandFunction f, RateLimit limit) {
+        // Also catches NaN, for which no delay can be computed either.
+        if ( ! (limit.rate > 0) )
+            throw std::invalid_argument("Rate limit of command '" + s + "' must be positive");
+        pimpl_->root_.add(s, Impl::Command{f, nullptr, std::make_shared<RateLimiter>(limit)});
+    }
+
+    void Console::registerCommand(const std::string & s, CommandFunction f, ArgumentSchema schema) {
+        pimpl_->root_.add(s, Impl::Command{f, nullptr, nullptr,
+                                           std::make_shared<const ArgumentSchema>(std::move(schema))});
+    }
+
+    Console::Argument Console::Argument::any(const std::string & name) {
+        return Argument([](const std::string &) { return true; }, name);
+    }
+
+    Console::Argument Console::Argument::integer(long min, long max) {
+        return Argument([min, max](const std::string & value) {
+            if ( value.empty() ) return false;
+            errno = 0;
+            char * end;
+            long number = std::strtol(value.c_str(), &end, 10);
+            return *end == '\0' && errno == 0 && number >= min && number <= max;
+        }, "integer in [" + std::to_string(min) + ", " + std::to_string(max) + "]");
+    }
+
+    Console::Argument Console::Argument::oneOf(const std::vector<std::string> & values) {
+        auto valid = std::make_shared<const std::unordered_set<std::string>>(begin(values), end(values));
+        std::string description;
+        for ( auto & value : values ) description += (description.empty() ? "" : "|") + value;
+
+        return Argument([valid](const std::string & value) {
+            return valid->count(value) > 0;
+        }, description);
+    }
+
+    Console::Argument Console::Argument::matching(const std::string & pattern) {
+        // The pattern is compiled here once, and then only executed for each call.
+#ifdef __GLIBCXX__
+        // Matched by simulating the automaton, whose stack does not grow
+        // with the value, and whose time does not explode on backtracking.
+        auto regex = std::make_shared<const std::regex>(pattern,
+            std::regex::ECMAScript | std::regex::optimize | std::regex_constants::__polynomial);
+        return Argument([regex](const std::string & value) {
+            return std::regex_match(value, *regex);
+        }, "value matching /" + pattern + "/");
+#else
+        // Backtracking matchers recurse for each character, so longer
+        // values are refused before they can overflow the stack.
+        static constexpr size_t maxLength = 1024;
+        auto regex = std::make_shared<const std::regex>(pattern, std::regex::ECMAScript | std::regex::optimize);
+        return Argument([regex](const std::string & value) {
+            return value.size() <= maxLength && std::regex_match(value, *regex);
+        }, "value matching /" + pattern + "/");
+#endif
+    }
+
+    Console::RateLimitStats Console::getRateLimitStats(const std::string & s) const {
+        auto it = pimpl_->root_.commands.find(s);
+        if ( it == end(pimpl_->root_.commands) || ! it->second.limiter ) return RateLimitStats{0, 0, 0};
+        return it->second.limiter->getStats();
+    }
+
+    void Console::registerAsyncCommand(const std::string & s, AsyncCommandFunction f) {
+        pimpl_->root_.add(s, Impl::Command{nullptr, f});
+    }
+
+    void Console::registerCompleter(const std::string & s, ArgumentCompleter completer) {
+        auto it = pimpl_->root_.commands.find(s);
+        if ( it == end(pimpl_->root_.commands) )
+            throw std::invalid_argument("Command '" + s + "' was never registered");
+        it->second.completer = std::make_shared<const ArgumentCompleter>(std::move(completer));
+    }
+
+    void Console::registerContext(const std::string & name, const std::string & greeting) {
+        auto & context = pimpl_->contexts_[name];
+        if ( context ) {
+            context->greeting = greeting;
+            return;
+        }
+        context.reset(new Impl::Registry(name, greeting));
+
+        // Each context has its own help, can enter further contexts, and
+        // exit goes back to the previous one rather than quitting.
+        context->add("help", Impl::Command{pimpl_->root_.commands["help"].function, nullptr});
+        context->add("enter", Impl::Command{pimpl_->root_.commands["enter"].function, nullptr});
+        context->add("quit", Impl::Command{[](const Arguments &) { return ReturnCode::Quit; }, nullptr});
+        context->add("exit", Impl::Command{[this](const Arguments &) { return pimpl_->leave(); }, nullptr});
+    }
+
+    void Console::registerCommand(const std::string & context, const std::string & s, CommandFunction f) {
+        auto it = pimpl_->contexts_.find(context);
+        if ( it == end(pimpl_->contexts_) )
+            throw std::invalid_argument("Context '" + context + "' was never registered");
+        it->second->add(s, Impl::Command{f, nullptr});
+    }
+
+    std::string Console::getContext() const {
+        return pimpl_->active_->name;
     }
 
     std::vector<std::string> Console::getRegisteredCommands() const {
         std::vector<std::string> allCommands;
-        for ( auto & pair : pimpl_->commands_ ) allCommands.push_back(pair.first);
+        for ( auto & pair : pimpl_->active_->commands ) allCommands.push_back(pair.first);
 
         return allCommands;
     }
@@ -89,7 +1352,18 @@ namespace CppReadline {
         pimpl_->history_ = history_get_history_state();
     }
 
+    void Console::initializeReadline() {
+        std::call_once(readlineInitialized, []{
+            emptyHistory = history_get_history_state();
+            rl_attempted_completion_function = &Console::getCommandCompletions;
+            rl_getc_function = &Console::getChar;
+            rl_completion_display_matches_hook = &Console::displayMatches;
+            rl_redisplay_function = &Console::redisplay;
+        });
+    }
+
     void Console::reserveConsole() {
+        initializeReadline();
         if ( currentConsole == this ) return;
 
         // Save state of other Console
@@ -106,60 +1380,528 @@ namespace CppReadline {
         currentConsole = this;
     }
 
+    bool Console::saveHistory(const std::string & path) {
+        reserveConsole();
+
+        std::vector<std::string> entries;
+        if ( HIST_ENTRY ** list = history_list() )
+            for ( ; *list; ++list ) entries.push_back((*list)->line);
+
+        return HistoryFile::save(path, entries);
+    }
+
+    bool Console::loadHistory(const std::string & path) {
+        HistoryFile file(path);
+        if ( ! file ) return false;
+
+        reserveConsole();
+        for ( auto & entry : file.load() ) add_history(entry.c_str());
+        return true;
+    }
+
     void Console::setGreeting(const std::string & greeting) {
-        pimpl_->greeting_ = greeting;
+        pimpl_->root_.greeting = greeting;
     }
 
     std::string Console::getGreeting() const {
-        return pimpl_->greeting_;
+        return pimpl_->root_.greeting;
+    }
+
+    std::ostream & Console::getOutput() {
+        return pimpl_->output();
+    }
+
+    void Console::setOutputPolicy(const OutputBuffer::Policy & policy) {
+        pimpl_->output_.setPolicy(policy);
+    }
+
+    void Console::setLatencyTracking(bool enabled) {
+        pimpl_->trackLatency_ = enabled;
+        pimpl_->keyPending_ = false;
+    }
+
+    Console::EditingLatency Console::getEditingLatency() const {
+        return EditingLatency{pimpl_->keystrokeLatency_.get(), pimpl_->completionLatency_.get()};
+    }
+
+    void Console::setAuditLog(std::shared_ptr<AuditLog> log) {
+        if ( log && pimpl_->session_.empty() ) {
+            static std::atomic<unsigned> sessions{0};
+            pimpl_->session_ = std::to_string(getpid()) + '-' + std::to_string(sessions++);
+
+            struct passwd * pw = getpwuid(geteuid());
+            const char * user = pw ? pw->pw_name : std::getenv("USER");
+            pimpl_->user_ = user ? user : std::to_string(geteuid());
+        }
+        pimpl_->audit_ = std::move(log);
+    }
+
+    Executor & Console::getExecutor() {
+        return pimpl_->executor();
     }
 
     int Console::executeCommand(const std::string & command) {
         // Convert input to vector
-        std::vector<std::string> inputs;
+        std::vector<std::string> inputs = split(command);
+
+        if ( inputs.size() == 0 ) return ReturnCode::Ok;
+
+        int result;
         {
-            std::istringstream iss(command);
-            std::copy(std::istream_iterator<std::string>(iss),
-                    std::istream_iterator<std::string>(),
-                    std::back_inserter(inputs));
+            Impl::CoalescedOutput coalesced(*pimpl_);
+            deferred = false;
+            result = pimpl_->dispatch(inputs);
         }
 
-        if ( inputs.size() == 0 ) return ReturnCode::Ok;
+        // Commands moved to the background are audited when they finish.
+        if ( pimpl_->audit_ && ! deferred )
+            pimpl_->audit_->record(pimpl_->session_, pimpl_->user_, command, result);
+
+        return result;
+    }
+
+    int Console::executeArgv(int argc, const char * const argv[]) {
+        if ( argc < 2 ) return ReturnCode::Ok;
+        Arguments inputs(argv + 1, argv + argc);
 
-        Impl::RegisteredCommands::iterator it;
-        if ( ( it = pimpl_->commands_.find(inputs[0]) ) != end(pimpl_->commands_) ) {
-            return static_cast<int>((it->second)(inputs));
+        int result;
+        {
+            Impl::CoalescedOutput coalesced(*pimpl_);
+            deferred = false;
+            result = pimpl_->dispatch(inputs);
         }
 
-        std::cout << "Command '" << inputs[0] << "' not found.\n";
-        return ReturnCode::Error;
+        if ( pimpl_->audit_ && ! deferred ) {
+            std::string command;
+            for ( auto & arg : inputs ) command += (command.empty() ? "" : " ") + arg;
+            pimpl_->audit_->record(pimpl_->session_, pimpl_->user_, command, result);
+        }
+        return result;
+    }
+
+    std::future<int> Console::retry(const Arguments & input) {
+        unsigned long attempts = 3;
+        auto backoff = std::chrono::milliseconds(100);
+        size_t i = 1;
+        bool valid = true;
+        try {
+            for ( ; i < input.size() && input[i][0] == '-' && valid; i += 2 ) {
+                if ( i + 1 == input.size() ) valid = false;
+                else if ( input[i] == "-n" ) attempts = std::stoul(input[i + 1]);
+                else if ( input[i] == "-backoff" ) backoff = parseDuration(input[i + 1]);
+                else valid = false;
+            }
+        } catch ( std::exception & ) {
+            valid = false;
+        }
+
+        std::promise<int> failed;
+        if ( ! valid || i >= input.size() || attempts == 0 || backoff.count() < 0 ) {
+            pimpl_->output() << "Usage: " << input[0] << " [-n attempts] [-backoff delay(ms|s|m)] command\n";
+            failed.set_value(ReturnCode::Error);
+            return failed.get_future();
+        }
+
+        // Each attempt after the first is scheduled on a timer rather than
+        // waited for, so that the Console is free in between.
+        struct Retry {
+            Arguments                   command;
+            unsigned long               attempts, attempt;
+            std::chrono::milliseconds   delay, waited;
+            std::promise<int>           result;
+            std::function<void()>       next;
+
+            Retry() : command(), attempts(), attempt(), delay(), waited(), result(), next() {}
+        };
+        auto state = std::make_shared<Retry>();
+        state->command.assign(begin(input) + i, end(input));
+        state->attempts = attempts;
+        state->attempt = 0;
+        state->delay = backoff;
+        state->waited = std::chrono::milliseconds(0);
+
+        std::weak_ptr<Retry> weak = state;
+        state->next = [this, weak]() {
+            auto r = weak.lock();
+            if ( ! r ) return;
+
+            ++r->attempt;
+            int result = invoke(r->command[0], Arguments(begin(r->command) + 1, end(r->command)));
+            // Asking to quit is not a failure worth retrying.
+            if ( result == ReturnCode::Ok || result == ReturnCode::Quit || r->attempt == r->attempts ) {
+                pimpl_->output() << "retry: '" << r->command[0] << "' "
+                                 << (result == ReturnCode::Quit ? "quit" : result ? "failed" : "succeeded")
+                                 << " after " << r->attempt << " attempt" << (r->attempt > 1 ? "s" : "")
+                                 << ", waiting " << r->waited.count() << "ms in total.\n";
+                r->result.set_value(result);
+                return;
+            }
+            pimpl_->output() << "retry: attempt " << r->attempt << " of '" << r->command[0] << "' returned "
+                             << result << ", retrying in " << r->delay.count() << "ms.\n";
+            r->waited += r->delay;
+            pimpl_->addTimer(r->delay, [r]{ r->next(); });
+            r->delay *= 2;
+        };
+
+        auto future = state->result.get_future();
+        state->next();
+        return future;
+    }
+
+    int Console::invoke(const std::string & name, Arguments args) {
+        args.insert(begin(args), name);
+        return pimpl_->dispatch(args);
+    }
+
+    void Console::setMaxNestingDepth(unsigned depth) {
+        pimpl_->maxNestingDepth_ = depth;
     }
 
     int Console::executeFile(const std::string & filename) {
-        std::ifstream input(filename);
+        // The echo and the output of all lines are written together.
+        Impl::CoalescedOutput coalesced(*pimpl_);
+
+        ScriptReader input(filename, pimpl_->executor());
         if ( ! input ) {
-            std::cout << "Could not find the specified file to execute.\n";
+            pimpl_->output() << "Could not find the specified file to execute.\n";
             return ReturnCode::Error;
         }
         std::string command;
         int counter = 0, result;
 
-        while ( std::getline(input, command)  ) {
+        // Scripts always wait for asynchronous commands, even when run from the prompt.
+        // The flag is only written when needed, as scripts may run concurrently.
+        bool interactive = pimpl_->interactive_;
+        if ( interactive ) pimpl_->interactive_ = false;
+        struct Restore {
+            bool & flag; bool value;
+            ~Restore() { if ( value ) flag = true; }
+        } restore{pimpl_->interactive_, interactive};
+
+        bool first = true;
+        while ( input.getline(command) ) {
             if ( command[0] == '#' ) continue; // Ignore comments
+            if ( first && split(command).empty() ) continue;
+            if ( first && isAnnotated(command) ) {
+                // The whole script is a dependency graph.
+                std::vector<std::string> lines{ command };
+                while ( input.getline(command) )
+                    if ( command[0] != '#' && ! split(command).empty() ) lines.push_back(std::move(command));
+                return executeGraph(lines);
+            }
+            first = false;
             // Report what the Console is executing.
-            std::cout << "[" << counter << "] " << command << '\n';
+            pimpl_->output() << "[" << counter << "] " << command << '\n';
             if ( (result = executeCommand(command)) ) return result;
-            ++counter; std::cout << '\n';
+            ++counter; pimpl_->output() << '\n';
         }
 
         // If we arrived successfully at the end, all is ok
         return ReturnCode::Ok;
     }
 
+    int Console::executeGraph(const std::vector<std::string> & lines) {
+        struct Node {
+            std::string             command;
+            std::vector<size_t>     dependents;
+            size_t                  waiting;    // Dependencies not completed yet.
+            bool                    pooled;     // Whether the line may run on the Executor.
+        };
+        std::vector<Node> nodes;
+        std::unordered_map<std::string, size_t> ids;
+        std::vector<std::vector<std::string>> dependencies;
+
+        for ( auto & line : lines ) {
+            auto tokens = split(line);
+            std::vector<std::string> after;
+            size_t t = 0;
+            for ( ; t < tokens.size() && isAnnotation(tokens[t]); ++t ) {
+                if ( tokens[t][0] == '@' ) {
+                    if ( ! ids.emplace(tokens[t].substr(1), nodes.size()).second ) {
+                        pimpl_->output() << "Duplicate line id '" << tokens[t].substr(1) << "'.\n";
+                        return ReturnCode::Error;
+                    }
+                } else {
+                    std::istringstream list(tokens[t].substr(6));
+                    std::string id;
+                    while ( std::getline(list, id, ',') ) if ( ! id.empty() ) after.push_back(id);
+                }
+            }
+            const bool pooled = t == tokens.size() || ! pimpl_->waitsForExecutor(tokens[t]);
+            std::string command;
+            for ( ; t < tokens.size(); ++t ) command += (command.empty() ? "" : " ") + tokens[t];
+
+            nodes.push_back(Node{std::move(command), {}, after.size(), pooled});
+            dependencies.push_back(std::move(after));
+        }
+        for ( size_t i = 0; i < nodes.size(); ++i ) {
+            for ( auto & id : dependencies[i] ) {
+                auto it = ids.find(id);
+                if ( it == end(ids) ) {
+                    pimpl_->output() << "Line " << i << " depends on unknown id '" << id << "'.\n";
+                    return ReturnCode::Error;
+                }
+                nodes[it->second].dependents.push_back(i);
+            }
+        }
+        // Check for cycles before running anything.
+        {
+            std::vector<size_t> waiting, ready;
+            for ( size_t i = 0; i < nodes.size(); ++i ) {
+                waiting.push_back(nodes[i].waiting);
+                if ( ! nodes[i].waiting ) ready.push_back(i);
+            }
+            size_t visited = 0;
+            while ( ! ready.empty() ) {
+                auto i = ready.back(); ready.pop_back(); ++visited;
+                for ( auto d : nodes[i].dependents ) if ( --waiting[d] == 0 ) ready.push_back(d);
+            }
+            if ( visited != nodes.size() ) {
+                pimpl_->output() << "The script dependencies contain a cycle.\n";
+                return ReturnCode::Error;
+            }
+        }
+
+        // Lines print from several threads, so they bypass the output buffer.
+        Impl::ReleasedOutput released(*pimpl_);
+
+        // Lines use the variables of the script, whichever thread runs them.
+        auto scope = pimpl_->currentScope();
+        ++pimpl_->graphs_;
+        struct Running {
+            std::atomic<unsigned> & graphs;
+            ~Running() { --graphs; }
+        } running{pimpl_->graphs_};
+
+        // Ready lines are queued, and taken by both the Executor and this
+        // thread, so that we never wait for lines which nobody has started.
+        // Lines which may wait for work on the Executor would deadlock it
+        // once they occupy all of its threads, so only this thread runs them.
+        struct State {
+            std::mutex              mutex;
+            std::condition_variable changed;
+            std::deque<size_t>      ready, local;
+            size_t                  running = 0, completed = 0;
+            int                     result = ReturnCode::Ok;
+            bool                    finished = false;
+
+            State() : mutex(), changed(), ready(), local() {}
+        };
+        auto state = std::make_shared<State>();
+
+        std::function<bool(std::unique_lock<std::mutex> &, bool)> runOne;
+        auto schedule = [this, state, &nodes, &runOne](size_t i) {
+            if ( ! nodes[i].pooled ) {
+                state->local.push_back(i);
+                return;
+            }
+            state->ready.push_back(i);
+            auto run = &runOne;
+            pimpl_->executor().execute([state, run]{
+                std::unique_lock<std::mutex> lock(state->mutex);
+                // Lines are only taken while executeGraph is still waiting for them.
+                if ( ! state->finished ) (*run)(lock, false);
+            });
+        };
+        runOne = [this, state, scope, &nodes, &schedule](std::unique_lock<std::mutex> & lock, bool caller) {
+            auto & queue = caller && ! state->local.empty() ? state->local : state->ready;
+            if ( queue.empty() || state->result ) return false;
+            auto i = queue.front();
+            queue.pop_front();
+            ++state->running;
+            lock.unlock();
+
+            std::ostringstream echo;
+            echo << "[" << i << "] " << nodes[i].command << '\n';
+            std::cout << echo.str();
+            int result;
+            {
+                ScriptScope pinned(pimpl_.get(), scope);
+                result = executeCommand(nodes[i].command);
+            }
+
+            lock.lock();
+            --state->running;
+            ++state->completed;
+            if ( result && ! state->result ) state->result = result;
+            if ( ! state->result )
+                for ( auto d : nodes[i].dependents )
+                    if ( --nodes[d].waiting == 0 ) schedule(d);
+            state->changed.notify_all();
+            return true;
+        };
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        for ( size_t i = 0; i < nodes.size(); ++i )
+            if ( ! nodes[i].waiting ) schedule(i);
+
+        while ( state->running > 0 || ( state->completed < nodes.size() && ! state->result ) ) {
+            if ( ! runOne(lock, true) ) state->changed.wait(lock);
+        }
+        state->finished = true;
+        return state->result;
+    }
+
+    int Console::executeFileSharded(const std::string & filename, unsigned shards, unsigned key) {
+        std::vector<std::string> lines;
+        {
+            ScriptReader input(filename, pimpl_->executor());
+            if ( ! input ) {
+                pimpl_->output() << "Could not find the specified file to execute.\n";
+                return ReturnCode::Error;
+            }
+            std::string command;
+            while ( input.getline(command) )
+                if ( command[0] != '#' ) lines.push_back(std::move(command)); // Ignore comments
+        }
+        if ( shards < 1 ) shards = 1;
+
+        // Workers inherit whatever is still buffered, so it must go out now.
+        std::cout.flush();
+        pimpl_->output_.flush();
+
+        std::vector<int> pipes;
+        std::vector<pid_t> workers;
+        for ( unsigned shard = 0; shard < shards; ++shard ) {
+            int fds[2];
+            if ( pipe(fds) != 0 ) break;
+            pid_t pid = fork();
+            if ( pid < 0 ) { close(fds[0]); close(fds[1]); break; }
+            if ( pid > 0 ) {
+                close(fds[1]);
+                pipes.push_back(fds[0]);
+                workers.push_back(pid);
+                continue;
+            }
+
+            // Worker: the threads of the parent's pool do not exist here, so
+            // whatever depends on them is leaked rather than destroyed, as
+            // that would wait for them. The parent audits our lines instead.
+            close(fds[0]);
+            for ( auto fd : pipes ) close(fd);
+            new std::shared_ptr<Executor>(std::move(pimpl_->executor_));
+            new std::shared_ptr<AuditLog>(std::move(pimpl_->audit_));
+            pimpl_->executor_ = std::make_shared<ThreadPool>(1);
+            pimpl_->interactive_ = false;
+
+            std::hash<std::string> hash;
+            for ( size_t i = 0; i < lines.size(); ++i ) {
+                auto inputs = split(lines[i]);
+                const std::string & k = key < inputs.size() ? inputs[key] : std::string();
+                if ( hash(k) % shards != shard ) continue;
+
+                std::ostringstream output;
+                auto terminal = std::cout.rdbuf(output.rdbuf());
+                int result = executeCommand(lines[i]);
+                std::cout.rdbuf(terminal);
+
+                auto text = output.str();
+                ShardFrame frame{i, result, text.size()};
+                if ( ! writeAll(fds[1], reinterpret_cast<const char *>(&frame), sizeof(frame)) ||
+                     ! writeAll(fds[1], text.data(), text.size()) || result )
+                    break;
+            }
+            close(fds[1]);
+            _exit(0);
+        }
+
+        // Collect the results of all workers, and print them back in order.
+        struct Line {
+            bool        done = false;
+            int         result = 0;
+            std::string output;
+
+            Line() : output() {}
+        };
+        std::vector<Line> results(lines.size());
+        std::vector<std::string> buffers(pipes.size());
+        size_t next = 0;
+        int result = ReturnCode::Ok;
+
+        std::vector<pollfd> fds;
+        for ( auto fd : pipes ) fds.push_back(pollfd{fd, POLLIN, 0});
+        size_t open = fds.size();
+        while ( open > 0 ) {
+            if ( poll(fds.data(), fds.size(), -1) < 0 ) {
+                if ( errno == EINTR ) continue;
+                break;
+            }
+            for ( size_t w = 0; w < fds.size(); ++w ) {
+                if ( fds[w].fd < 0 || ! fds[w].revents ) continue;
+
+                char chunk[65536];
+                ssize_t r = read(fds[w].fd, chunk, sizeof(chunk));
+                if ( r < 0 && errno == EINTR ) continue;
+                if ( r <= 0 ) {
+                    close(fds[w].fd);
+                    fds[w].fd = -1;
+                    --open;
+                    continue;
+                }
+                auto & buffer = buffers[w];
+                buffer.append(chunk, r);
+
+                ShardFrame frame;
+                while ( buffer.size() >= sizeof(frame) ) {
+                    std::memcpy(&frame, buffer.data(), sizeof(frame));
+                    if ( buffer.size() < sizeof(frame) + frame.size || frame.line >= results.size() ) break;
+                    // Whatever ran is audited, even if it is never reported.
+                    if ( pimpl_->audit_ )
+                        pimpl_->audit_->record(pimpl_->session_, pimpl_->user_, lines[frame.line], static_cast<int>(frame.result));
+                    auto & line = results[frame.line];
+                    line.done = true;
+                    line.result = static_cast<int>(frame.result);
+                    line.output = buffer.substr(sizeof(frame), frame.size);
+                    buffer.erase(0, sizeof(frame) + frame.size);
+                }
+            }
+            // Report in the same format as executeFile, stopping at the first failure.
+            for ( ; next < lines.size() && results[next].done && ! result; ++next ) {
+                pimpl_->output() << "[" << next << "] " << lines[next] << '\n' << results[next].output;
+                if ( (result = results[next].result) ) {
+                    // Later lines would not be reported, so they must not run either.
+                    for ( auto pid : workers ) kill(pid, SIGTERM);
+                    break;
+                }
+                pimpl_->output() << '\n';
+                results[next].output.clear();
+            }
+        }
+
+        for ( auto pid : workers ) {
+            int status;
+            while ( waitpid(pid, &status, 0) < 0 && errno == EINTR );
+        }
+
+        if ( ! result && next < lines.size() ) {
+            pimpl_->output() << "[" << next << "] " << lines[next] << " was not executed.\n";
+            return ReturnCode::Error;
+        }
+        return result;
+    }
+
     int Console::readLine() {
         reserveConsole();
+        // Registration has most likely settled by now, so we can index commands
+        // while the user is typing.
+        pimpl_->prewarmCompletionIndex();
+        {
+            // Everything printed since the last prompt goes out in one go.
+            Impl::CoalescedOutput coalesced(*pimpl_);
+            pimpl_->runDueTimers();
+            pimpl_->reportFinishedJobs();
+        }
 
-        char * buffer = readline(pimpl_->greeting_.c_str());
+        pimpl_->cancelSpeculation();
+        char * buffer = readline(pimpl_->active_->greeting.c_str());
+        // Accepting the line does not redraw it.
+        pimpl_->keyPending_ = false;
+        if ( pimpl_->controlQuit_ ) {
+            // A control command asked us to quit while the user was typing.
+            pimpl_->controlQuit_ = false;
+            free(buffer);
+            return ReturnCode::Quit;
+        }
         if ( !buffer ) {
             std::cout << '\n'; // EOF doesn't put last endline so we put that so that it looks uniform.
             return ReturnCode::Quit;
@@ -172,23 +1914,237 @@ namespace CppReadline {
         std::string line(buffer);
         free(buffer);
 
-        return executeCommand(line);
+        pimpl_->interactive_ = true;
+        int result = executeCommand(line);
+        pimpl_->interactive_ = false;
+
+        return result;
+    }
+
+    bool Console::openControlChannel(const std::string & path, const std::string & replyPath) {
+        closeControlChannel();
+
+        // Existing files must be pipes: anything else would never stop being readable.
+        struct stat info;
+        for ( auto & fifo : { path, replyPath } ) {
+            if ( fifo.empty() ) continue;
+            if ( mkfifo(fifo.c_str(), 0600) != 0 && errno != EEXIST ) return false;
+            if ( stat(fifo.c_str(), &info) != 0 || ! S_ISFIFO(info.st_mode) ) return false;
+        }
+
+        pimpl_->controlFd_ = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        // We also keep the pipe open for writing, otherwise it would signal
+        // end of file every time a writer goes away.
+        pimpl_->controlKeepAlive_ = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        // The path may have been replaced since we checked it.
+        if ( pimpl_->controlFd_ < 0 || pimpl_->controlKeepAlive_ < 0 ||
+             fstat(pimpl_->controlFd_, &info) != 0 || ! S_ISFIFO(info.st_mode) ) {
+            closeControlChannel();
+            return false;
+        }
+        pimpl_->replyPath_ = replyPath;
+        return true;
+    }
+
+    void Console::closeControlChannel() {
+        pimpl_->closeControlChannel();
+    }
+
+    void Console::serviceControlChannel() {
+        char chunk[4096];
+        ssize_t r;
+        while ( ( r = read(pimpl_->controlFd_, chunk, sizeof(chunk)) ) > 0 )
+            pimpl_->controlBuffer_.append(chunk, r);
+
+        size_t newline;
+        while ( ( newline = pimpl_->controlBuffer_.find('\n') ) != std::string::npos ) {
+            std::string command = pimpl_->controlBuffer_.substr(0, newline);
+            pimpl_->controlBuffer_.erase(0, newline + 1);
+
+            int result;
+            {
+                // Move the line being edited out of the way while the command runs.
+                SuspendedLine suspended;
+                std::cout << "(control) " << command << '\n';
+
+                std::ostringstream output;
+                auto terminal = std::cout.rdbuf(output.rdbuf());
+                result = executeCommand(command);
+                std::cout.rdbuf(terminal);
+                pimpl_->reply(output.str());
+            }
+
+            if ( result == ReturnCode::Quit ) {
+                pimpl_->controlQuit_ = true;
+                return;
+            }
+        }
+    }
+
+    int Console::getChar(FILE * stream) {
+        while ( currentConsole ) {
+            auto & impl = *currentConsole->pimpl_;
+            int timeout = impl.nextTimerTimeout();
+            // A pause in typing is a good time to start completing the current word.
+            const int pause = impl.speculationTimeout();
+            const bool speculating = pause >= 0 && ( timeout < 0 || pause < timeout );
+            if ( speculating ) timeout = pause;
+            if ( impl.controlFd_ < 0 && timeout < 0 ) break;
+
+            // A negative descriptor is ignored by poll.
+            pollfd fds[2] = {
+                { fileno(stream), POLLIN, 0 },
+                { impl.controlFd_, POLLIN, 0 }
+            };
+            int ready = poll(fds, 2, timeout);
+            if ( ready < 0 ) {
+                if ( errno != EINTR ) break;
+                rl_check_signals();
+                continue;
+            }
+            if ( ready == 0 ) {
+                if ( speculating ) {
+                    impl.speculate();
+                    continue;
+                }
+                SuspendedLine suspended;
+                impl.runDueTimers();
+                impl.reportFinishedJobs();
+                continue;
+            }
+            if ( fds[1].revents & POLLIN ) {
+                currentConsole->serviceControlChannel();
+                if ( currentConsole->pimpl_->controlQuit_ ) {
+                    // Accept an empty line, so that readLine() can return.
+                    rl_replace_line("", 0);
+                    return '\n';
+                }
+            }
+            if ( fds[0].revents ) break;
+        }
+        int c = rl_getc(stream);
+        // Keys arriving before the line is redrawn are measured from the first.
+        if ( currentConsole && currentConsole->pimpl_->trackLatency_ && ! currentConsole->pimpl_->keyPending_ ) {
+            currentConsole->pimpl_->keyReceived_ = Impl::Clock::now();
+            currentConsole->pimpl_->keyPending_ = true;
+        }
+        return c;
+    }
+
+    void Console::redisplay() {
+        rl_redisplay();
+        if ( currentConsole && currentConsole->pimpl_->keyPending_ ) {
+            auto & impl = *currentConsole->pimpl_;
+            impl.keystrokeLatency_.record(Impl::Clock::now() - impl.keyReceived_);
+            impl.keyPending_ = false;
+        }
     }
 
-    char ** Console::getCommandCompletions(const char * text, int start, int) {
+    char ** Console::getCommandCompletions(const char * text, int start, int end) {
+        const auto started = Impl::Clock::now();
         char ** completionList = nullptr;
 
-        if ( start == 0 )
-            completionList = rl_completion_matches(text, &Console::commandIterator);
+        if ( start == 0 ) {
+            // Use the prebuilt index if available, otherwise fall back to scanning all commands.
+            auto index = currentConsole ? currentConsole->pimpl_->readyCompletionIndex() : nullptr;
+            if ( index ) {
+                currentConsole->pimpl_->completionMatches_ = index->find(text);
+                completionList = rl_completion_matches(text, &Console::indexIterator);
+            } else {
+                completionList = rl_completion_matches(text, &Console::commandIterator);
+            }
+        } else if ( currentConsole && currentConsole->pimpl_->completeArgument(std::string(rl_line_buffer, end)) ) {
+            // Commands with a completer never complete file names.
+            rl_attempted_completion_over = 1;
+            completionList = rl_completion_matches(text, &Console::indexIterator);
+        }
 
+        if ( currentConsole && currentConsole->pimpl_->trackLatency_ )
+            currentConsole->pimpl_->completionLatency_.record(Impl::Clock::now() - started);
         return completionList;
     }
 
+    void Console::displayMatches(char ** matches, int count, int maxLength) {
+        int rows, columns;
+        rl_get_screen_size(&rows, &columns);
+        columns = std::max(columns, 1);
+        // Leave room for the footer and the prompt.
+        const int pageRows = std::max(rows - 2, 1);
+
+        // Lists which fit in a page are left to readline.
+        const int perRow = std::max(columns / (maxLength + 2), 1);
+        if ( ! currentConsole || (count + perRow - 1) / perRow <= pageRows ) {
+            rl_display_match_list(matches, count, maxLength);
+            rl_forced_update_display();
+            return;
+        }
+
+        // Pressing Tab again on the same list shows the following page.
+        auto & page = currentConsole->pimpl_->completionPage_;
+        if ( page.count != count || page.first != matches[1] || page.last != matches[count] ) {
+            page.count = count;
+            page.first = matches[1];
+            page.last = matches[count];
+            page.next = 0;
+        }
+        if ( page.next >= count ) page.next = 0;
+
+        // A few long matches should not spread all others apart, so the
+        // column width comes from a sample; longer matches span more columns.
+        const int samples = std::min(count, 256);
+        size_t width = 0;
+        for ( int s = 0; s < samples; ++s )
+            width = std::max(width, strlen(matches[1 + static_cast<long>(s) * count / samples]));
+        width += 2;
+
+        std::string text;
+        const int first = page.next;
+        int row = 0;
+        size_t position = 0, padding = 0;
+        while ( page.next < count ) {
+            const char * match = matches[1 + page.next];
+            const size_t length = strlen(match);
+            const size_t cells = (length + 2 + width - 1) / width * width;
+
+            if ( position > 0 && position + cells > static_cast<size_t>(columns) ) {
+                if ( ++row == pageRows ) break;
+                text += '\n';
+                position = padding = 0;
+            }
+            text.append(padding, ' ');
+            text += match;
+            position += cells;
+            padding = cells - length;
+            ++page.next;
+        }
+        text += "\n-- " + std::to_string(first + 1) + "-" + std::to_string(page.next) +
+                " of " + std::to_string(count) + " matches" +
+                (page.next < count ? ", Tab for more --" : " --");
+
+        rl_crlf();
+        fputs(text.c_str(), rl_outstream);
+        rl_crlf();
+        rl_forced_update_display();
+    }
+
+    char * Console::indexIterator(const char *, int state) {
+        static size_t i;
+        if (!currentConsole)
+            return nullptr;
+        auto& matches = currentConsole->pimpl_->completionMatches_;
+
+        if ( state == 0 ) i = 0;
+
+        if ( i < matches.size() )
+            return strdup(matches[i++].c_str());
+        return nullptr;
+    }
+
     char * Console::commandIterator(const char * text, int state) {
         static Impl::RegisteredCommands::iterator it;
         if (!currentConsole)
             return nullptr;
-        auto& commands = currentConsole->pimpl_->commands_;
+        auto& commands = currentConsole->pimpl_->active_->commands;
 
         if ( state == 0 ) it = begin(commands);
 
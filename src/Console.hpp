@@ -1,10 +1,18 @@
 #ifndef CONSOLE_CONSOLE_HEADER_FILE
 #define CONSOLE_CONSOLE_HEADER_FILE
 
+#include <chrono>
+#include <cstdio>
 #include <functional>
 #include <string>
 #include <vector>
 #include <memory>
+#include <future>
+#include <ostream>
+
+#include "Executor.hpp"
+#include "AuditLog.hpp"
+#include "OutputBuffer.hpp"
 
 namespace CppReadline {
     class Console {
@@ -21,27 +29,167 @@ namespace CppReadline {
             using Arguments = std::vector<std::string>;
             using CommandFunction = std::function<int(const Arguments &)>;
 
+            /**
+             * @brief This is the function type for commands which complete asynchronously.
+             *
+             * Instead of the result, these functions return a future which
+             * will hold it. They can use getExecutor() to run their work.
+             */
+            using AsyncCommandFunction = std::function<std::future<int>(const Arguments &)>;
+
+            /**
+             * @brief Functions which complete the arguments of a command.
+             *
+             * They receive the words before the one being completed, starting
+             * with the command name, and the (possibly empty) beginning of
+             * the word, and return the candidates for it.
+             */
+            using ArgumentCompleter = std::function<std::vector<std::string>(const Arguments &, const std::string &)>;
+
             enum ReturnCode {
                 Quit = -1,
                 Ok = 0,
                 Error = 1 // Or greater!
             };
 
+            /**
+             * @brief This describes how often a command is allowed to run.
+             *
+             * Calls over the limit are either delayed until allowed, or
+             * immediately fail with an Error.
+             */
+            struct RateLimit {
+                enum class Policy { Delay, Fail };
+
+                double      rate;   // Calls per second allowed on average.
+                unsigned    burst;  // Calls allowed at once before throttling kicks in.
+                Policy      policy;
+            };
+
+            /**
+             * @brief This describes which values are valid for an argument of a command.
+             *
+             * Arguments are checked by the Console before calling the command,
+             * so that commands do not need to validate their input themselves.
+             * All the work which can be done in advance, like compiling
+             * patterns, is done when the Argument is created.
+             */
+            class Argument {
+                public:
+                    /**
+                     * @brief Any value is valid.
+                     *
+                     * @param name The name of the argument, used in usage messages.
+                     */
+                    static Argument any(const std::string & name);
+                    /**
+                     * @brief The value must be an integer within [min, max].
+                     */
+                    static Argument integer(long min, long max);
+                    /**
+                     * @brief The value must be one of the specified strings.
+                     */
+                    static Argument oneOf(const std::vector<std::string> & values);
+                    /**
+                     * @brief The whole value must match the specified ECMAScript regular expression.
+                     *
+                     * Back-references are not supported, so that values of
+                     * any length are matched in linear time.
+                     *
+                     * @throw std::regex_error If the pattern is malformed or uses back-references.
+                     */
+                    static Argument matching(const std::string & pattern);
+
+                    /**
+                     * @brief Whether the value is valid.
+                     */
+                    bool check(const std::string & value) const { return check_(value); }
+                    /**
+                     * @brief A short description of the valid values.
+                     */
+                    const std::string & describe() const { return description_; }
+
+                private:
+                    Argument(std::function<bool(const std::string &)> check, std::string description) :
+                            check_(std::move(check)), description_(std::move(description)) {}
+
+                    std::function<bool(const std::string &)>    check_;
+                    std::string                                 description_;
+            };
+            using ArgumentSchema = std::vector<Argument>;
+
+            /**
+             * @brief Counters of a rate limited command.
+             */
+            struct RateLimitStats {
+                unsigned long allowed;  // Calls which were executed.
+                unsigned long delayed;  // Calls which were executed after waiting.
+                unsigned long rejected; // Calls which failed due to the limit.
+            };
+
+            /**
+             * @brief A histogram of latencies, in buckets of doubling width.
+             *
+             * Bucket 0 counts latencies below one microsecond, and bucket i
+             * those from 2^(i-1) up to 2^i microseconds. The last bucket also
+             * counts everything longer.
+             */
+            struct LatencyHistogram {
+                std::vector<unsigned long>  buckets;
+                unsigned long               count;
+                std::chrono::microseconds   total;
+                std::chrono::microseconds   max;
+            };
+
+            /**
+             * @brief How responsive line editing has been.
+             */
+            struct EditingLatency {
+                LatencyHistogram keystroke;     // From a key arriving to the line being redrawn.
+                LatencyHistogram completion;    // Spent computing completions.
+            };
+
             /**
              * @brief Basic constructor.
              *
-             * The Console comes with two predefined commands: "quit" and
-             * "exit", which both terminate the console, "help" which prints a
-             * list of all registered commands, and "run" which executes script
-             * files.
+             * The Console comes with these predefined commands:
+             *
+             * - "quit" and "exit", which both terminate the console;
+             * - "help", which prints a list of all registered commands;
+             * - "history", which lists the history entries containing some text;
+             * - "retry", which repeats a failing command with exponential
+             *   backoff, without blocking the prompt in between;
+             * - "enter", which switches to a context (see registerContext());
+             * - "run", which executes a script file, which can read the
+             *   variables of the caller but whose assignments are discarded
+             *   when it ends;
+             * - "source", which does the same but lets the script change the
+             *   variables of the caller;
+             * - "expr", which evaluates arithmetic expressions (see
+             *   Expression), optionally assigning them to variables as in
+             *   "expr x = 2 * (y + 1)".
              *
              * These commands can be overridden or unregistered - but remember
              * to leave at least one to quit ;).
              *
+             * The constructor does not touch GNU readline: its global state is
+             * only initialized by the first call to readLine().
+             *
              * @param greeting This represents the prompt of the Console.
              */
             explicit Console(std::string const& greeting);
 
+            /**
+             * @brief Constructor which schedules all asynchronous work on the given Executor.
+             *
+             * Without an Executor the Console uses ThreadPool::getDefault(),
+             * which is shared by all Consoles.
+             *
+             * @param greeting This represents the prompt of the Console.
+             * @param executor The Executor used for all asynchronous work.
+             */
+            Console(std::string const& greeting, std::shared_ptr<Executor> executor);
+
             /**
              * @brief Basic destructor.
              *
@@ -59,16 +207,147 @@ namespace CppReadline {
              */
             void registerCommand(const std::string & s, CommandFunction f);
 
+            /**
+             * @brief This function registers a new command which cannot run more often than the specified limit.
+             *
+             * If the command already existed, it overwrites the previous entry.
+             *
+             * @param s The name of the command as inserted by the user.
+             * @param f The function that will be called once the user writes the command.
+             * @param limit The rate limit enforced before each call of the command.
+             *
+             * @throw std::invalid_argument If the rate of the limit is not positive.
+             */
+            void registerCommand(const std::string & s, CommandFunction f, RateLimit limit);
+
+            /**
+             * @brief This function registers a new command whose arguments are validated before it is called.
+             *
+             * The command is only called when it receives exactly one argument
+             * per element of the schema, and each of them is valid. Otherwise
+             * the Console prints why and returns an Error.
+             *
+             * If the command already existed, it overwrites the previous entry.
+             *
+             * @param s The name of the command as inserted by the user.
+             * @param f The function that will be called once the user writes the command.
+             * @param schema The valid values for each of the arguments of the command.
+             */
+            void registerCommand(const std::string & s, CommandFunction f, ArgumentSchema schema);
+
+            /**
+             * @brief This function returns the counters of a rate limited command.
+             *
+             * @param s The name of the command.
+             *
+             * @return The counters of the command, all zero if it is not rate limited.
+             */
+            RateLimitStats getRateLimitStats(const std::string & s) const;
+
+            /**
+             * @brief This function registers a new asynchronous command within the Console.
+             *
+             * When the command is executed via readLine() and its result is not
+             * ready yet, the Console immediately returns Ok and reports the
+             * result before a later prompt. Otherwise, as in executeCommand()
+             * and executeFile(), the Console waits for the result.
+             *
+             * If the command already existed, it overwrites the previous entry.
+             *
+             * @param s The name of the command as inserted by the user.
+             * @param f The function that will be called once the user writes the command.
+             */
+            void registerAsyncCommand(const std::string & s, AsyncCommandFunction f);
+
+            /**
+             * @brief This function registers how the arguments of a command are completed.
+             *
+             * Without a completer, arguments complete to file names. Once the
+             * user pauses while typing an argument, the Console starts the
+             * completion in the background on its Executor, so that it is
+             * likely done when Tab is pressed; a query still waiting for the
+             * Executor by then is run on the spot instead. Queries for words
+             * which have changed since are not started, or their results are
+             * discarded.
+             * The completer may thus be called from any thread.
+             *
+             * Registering the command again removes its completer.
+             *
+             * @param s The name of the command, which must already be registered.
+             * @param completer The function which provides the candidates.
+             */
+            void registerCompleter(const std::string & s, ArgumentCompleter completer);
+
+            /**
+             * @brief This function registers a new context, which can then be switched to with "enter <name>".
+             *
+             * A context has its own commands, prompt and completion, which
+             * replace those of the Console while it is active. Each context
+             * comes with "help", "enter", "quit", and "exit", which goes back
+             * to the previously active context.
+             *
+             * If the context already existed, only its prompt is changed.
+             *
+             * @param name The name of the context.
+             * @param greeting The prompt of the Console while the context is active.
+             */
+            void registerContext(const std::string & name, const std::string & greeting);
+
+            /**
+             * @brief This function registers a new command within a context.
+             *
+             * If the command already existed, it overwrites the previous entry.
+             *
+             * @param context The name of the context, which must have been registered.
+             * @param s The name of the command as inserted by the user.
+             * @param f The function that will be called once the user writes the command.
+             *
+             * @throw std::invalid_argument If the context was never registered.
+             */
+            void registerCommand(const std::string & context, const std::string & s, CommandFunction f);
+
+            /**
+             * @brief Gets the name of the currently active context.
+             *
+             * @return The name of the context, or an empty string when no context is active.
+             */
+            std::string getContext() const;
+
             /**
              * @brief This function returns a list with the currently available commands.
              *
+             * These are the commands of the currently active context.
+             *
              * @return A vector containing all registered commands names.
              */
             std::vector<std::string> getRegisteredCommands() const;
 
+            /**
+             * @brief This function saves the history of this Console to a file.
+             *
+             * The file is written in the compact format of HistoryFile.
+             *
+             * @param path The pathname of the file, which is replaced if it exists.
+             *
+             * @return Whether the history was saved successfully.
+             */
+            bool saveHistory(const std::string & path);
+
+            /**
+             * @brief This function appends the entries of a history file to the history of this Console.
+             *
+             * @param path The pathname of a file written by saveHistory().
+             *
+             * @return Whether the file could be read.
+             */
+            bool loadHistory(const std::string & path);
+
             /**
              * @brief Sets the prompt for this Console.
              *
+             * This is the prompt used when no context is active; contexts use
+             * the prompt they were registered with.
+             *
              * @param greeting The new greeting.
              */
             void setGreeting(const std::string & greeting);
@@ -80,33 +359,214 @@ namespace CppReadline {
              */
             std::string getGreeting() const;
 
+            /**
+             * @brief Gets the stream commands should print to.
+             *
+             * While a command runs, this is the Console's own buffer, which
+             * is written out once the command is done, when it is flushed, or
+             * earlier when it fills up. Built-in commands print here as well.
+             * Outside of commands, on threads other than the one running the
+             * command, or when std::cout does not write to the standard
+             * output, this is simply std::cout.
+             *
+             * The stream should be obtained again by each command run, and
+             * only used from the thread running it. Output printed to
+             * std::cout in the meantime may come out before it.
+             *
+             * @return The stream to print to.
+             */
+            std::ostream & getOutput();
+
+            /**
+             * @brief Sets how the output of commands is coalesced before reaching the terminal.
+             *
+             * While a command runs, what it prints to getOutput() is gathered
+             * and written in large chunks. If the terminal cannot keep up,
+             * the policy decides whether commands wait for it or whether
+             * their output is dropped, in which case a summary of what was
+             * lost is printed once the terminal catches up.
+             *
+             * @param policy The policy to use.
+             */
+            void setOutputPolicy(const OutputBuffer::Policy & policy);
+
+            /**
+             * @brief Sets where this Console records every command run through executeCommand().
+             *
+             * Each Console is a separate session in the log, and the same log
+             * can be shared by multiple Consoles. Commands moved to the
+             * background are recorded once they finish, with their result.
+             *
+             * @param log The log to use, or nullptr to stop recording.
+             */
+            void setAuditLog(std::shared_ptr<AuditLog> log);
+
+            /**
+             * @brief Gets the Executor on which this Console schedules its asynchronous work.
+             *
+             * Commands can use it to run their own work without creating
+             * additional threads.
+             *
+             * @return The Executor of this Console.
+             */
+            Executor & getExecutor();
+
+            /**
+             * @brief Sets whether this Console measures the latency of line editing.
+             *
+             * Measuring is off by default. Turning it off keeps what was
+             * measured so far.
+             *
+             * @param enabled Whether to measure.
+             */
+            void setLatencyTracking(bool enabled);
+
+            /**
+             * @brief Gets the latencies measured while the user was editing lines.
+             *
+             * This can be called from any thread.
+             *
+             * @return The histograms of the latencies measured so far.
+             */
+            EditingLatency getEditingLatency() const;
+
             /**
              * @brief This function executes an arbitrary string as if it was inserted via stdin.
              *
+             * The string is split on whitespace, which includes the Unicode
+             * space characters (such as non-breaking spaces) encoded in UTF-8.
+             *
              * @param command The command that needs to be executed.
              *
              * @return The result of the operation.
              */
             int executeCommand(const std::string & command);
 
+            /**
+             * @brief This function executes a command given as the arguments of a program.
+             *
+             * The arguments are dispatched as they are, without being joined
+             * and split again, so they can contain spaces. Readline is not
+             * involved at all, which keeps running a single command from a
+             * shell as cheap as possible.
+             *
+             * @param argc The number of arguments, as passed to main().
+             * @param argv The arguments, as passed to main(): argv[0] is the
+             *             name of the program, argv[1] the command.
+             *
+             * @return The result of the command, or Ok if there is none.
+             */
+            int executeArgv(int argc, const char * const argv[]);
+
+            /**
+             * @brief This function executes a command directly with the specified arguments.
+             *
+             * This is meant for commands which need to call other commands:
+             * the arguments are passed as they are, without being formatted
+             * into a string and split again.
+             *
+             * @param name The name of the command.
+             * @param args The arguments of the command, not including its name.
+             *
+             * @return The result of the operation.
+             */
+            int invoke(const std::string & name, Arguments args);
+
+            /**
+             * @brief Sets how deeply commands can call other commands.
+             *
+             * This applies to commands executed from within other commands in
+             * any way, be it invoke(), executeCommand() or scripts. A call over
+             * the limit returns an Error, and the chain of calls which led to
+             * it is printed. The default is 64.
+             *
+             * @param depth The maximum number of nested commands.
+             */
+            void setMaxNestingDepth(unsigned depth);
+
             /**
              * @brief This function calls an external script and executes all commands inside.
              *
              * This function stops execution as soon as any single command returns something
              * different from 0, be it a quit code or an error code.
              *
+             * If the first command of the script is annotated, the script is
+             * instead a dependency graph. Lines can be named with "@id", and
+             * list what they need to wait for with "after:id1,id2", before
+             * the command itself:
+             *
+             *     @fetch download package
+             *     @config configure
+             *     after:fetch,config install package
+             *
+             * Lines which do not wait for anything start right away, and each
+             * line starts as soon as what it waits for completes, running
+             * concurrently on the Executor. Lines running asynchronous
+             * commands or other scripts, which may themselves wait for the
+             * Executor, run on the calling thread instead. All commands in
+             * such scripts, built-in or not, may thus run at the same time:
+             * registered commands must be thread-safe, built-in ones are, but
+             * contexts cannot be entered or left while the script runs.
+             * Output of the lines may interleave. After a failure no more
+             * lines are started.
+             *
              * @param filename The pathname of the script.
              *
              * @return What the last command executed returned.
              */
             int executeFile(const std::string & filename);
 
+            /**
+             * @brief This function executes a script split among multiple worker processes.
+             *
+             * Each line is executed by the worker selected by hashing one of
+             * its elements, so that lines with the same key always run in the
+             * same process, in order. Commands thus run in parallel without
+             * needing to be thread-safe, but changes they make to the state
+             * of the program are lost when the workers exit.
+             *
+             * The output each command writes to std::cout is collected and
+             * printed as executeFile() would, in the order of the script.
+             * Each worker stops at the first command returning something
+             * different from 0, and so does the report; once a failure is
+             * reported, the other workers are terminated. Every command which
+             * ran is recorded in the audit log, even if it is not reported.
+             *
+             * @param filename The pathname of the script.
+             * @param shards The number of worker processes.
+             * @param key The position of the element used as key, 0 being the command name.
+             *
+             * @return What the last reported command returned.
+             */
+            int executeFileSharded(const std::string & filename, unsigned shards, unsigned key);
+
             /**
              * @brief This function executes a single command from the user via stdin.
              *
              * @return The result of the operation.
              */
             int readLine();
+
+            /**
+             * @brief This function makes the Console accept commands from a named pipe.
+             *
+             * While readLine() waits for the user, each line written to the
+             * pipe (e.g. with `echo cmd > path`) is executed as a command.
+             * Its output goes to the reply pipe, if somebody is reading it,
+             * instead of the terminal. Both pipes are created if needed;
+             * existing files which are not pipes are refused.
+             *
+             * @param path The pathname of the pipe to read commands from.
+             * @param replyPath The pathname of the pipe where the output of commands is written, or empty to discard it.
+             *
+             * @return Whether the pipes could be created and opened.
+             */
+            bool openControlChannel(const std::string & path, const std::string & replyPath);
+
+            /**
+             * @brief This function stops accepting commands from the named pipe, if any.
+             */
+            void closeControlChannel();
         private:
             Console(const Console&) = delete;
             Console(Console&&) = delete;
@@ -117,6 +577,10 @@ namespace CppReadline {
             using PImpl = ::std::unique_ptr<Impl>;
             PImpl pimpl_;
 
+            /**
+             * @brief This function initializes the GNU readline globals, the first time any Console needs them.
+             */
+            static void initializeReadline();
             /**
              * @brief This function saves the current state so that some other Console can make use of the GNU readline facilities.
              */
@@ -125,6 +589,18 @@ namespace CppReadline {
              * @brief This function reserves the use of the GNU readline facilities to the calling Console instance.
              */
             void reserveConsole();
+            /**
+             * @brief This function executes all complete commands which arrived on the control pipe.
+             */
+            void serviceControlChannel();
+            /**
+             * @brief This function executes the lines of an annotated script as a dependency graph.
+             */
+            int executeGraph(const std::vector<std::string> & lines);
+            /**
+             * @brief This function implements the "retry" command.
+             */
+            std::future<int> retry(const Arguments & input);
 
             // GNU newline interface to our commands.
             using commandCompleterFunction = char**(const char * text, int start, int end);
@@ -132,6 +608,19 @@ namespace CppReadline {
 
             static commandCompleterFunction getCommandCompletions;
             static commandIteratorFunction commandIterator;
+            static commandIteratorFunction indexIterator;
+
+            // Shows long lists of completions a page at a time.
+            using displayMatchesFunction = void(char ** matches, int count, int maxLength);
+            static displayMatchesFunction displayMatches;
+
+            // Redraws the line, noting how long the key which caused it waited.
+            using redisplayFunction = void();
+            static redisplayFunction redisplay;
+
+            // Waits for either a key or a control command, instead of just a key.
+            using getCharFunction = int(FILE * stream);
+            static getCharFunction getChar;
     };
 }
 
@@ -0,0 +1,71 @@
+#include "Executor.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CppReadline {
+    struct ThreadPool::Impl {
+        std::mutex                  mutex_;
+        std::condition_variable     available_;
+        std::deque<Executor::Task>  tasks_;
+        std::vector<std::thread>    workers_;
+        bool                        stopping_ = false;
+
+        Impl() : mutex_(), available_(), tasks_(), workers_() {}
+
+        Impl(Impl const&) = delete;
+        Impl(Impl&&) = delete;
+        Impl& operator = (Impl const&) = delete;
+        Impl& operator = (Impl&&) = delete;
+
+        void work() {
+            while ( true ) {
+                Executor::Task task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    available_.wait(lock, [this]{ return stopping_ || !tasks_.empty(); });
+                    // We only stop once everything queued has been run.
+                    if ( tasks_.empty() ) return;
+                    task = std::move(tasks_.front());
+                    tasks_.pop_front();
+                }
+                task();
+            }
+        }
+    };
+
+    ThreadPool::ThreadPool(unsigned threads)
+        : pimpl_{ new Impl }
+    {
+        if ( threads == 0 ) threads = std::thread::hardware_concurrency();
+        if ( threads == 0 ) threads = 1;
+
+        for ( unsigned i = 0; i < threads; ++i )
+            pimpl_->workers_.emplace_back(&Impl::work, pimpl_.get());
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(pimpl_->mutex_);
+            pimpl_->stopping_ = true;
+        }
+        pimpl_->available_.notify_all();
+        for ( auto & worker : pimpl_->workers_ ) worker.join();
+    }
+
+    void ThreadPool::execute(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(pimpl_->mutex_);
+            pimpl_->tasks_.push_back(std::move(task));
+        }
+        pimpl_->available_.notify_one();
+    }
+
+    std::shared_ptr<Executor> ThreadPool::getDefault() {
+        static std::shared_ptr<Executor> pool = std::make_shared<ThreadPool>();
+        return pool;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef CONSOLE_EXECUTOR_HEADER_FILE
+#define CONSOLE_EXECUTOR_HEADER_FILE
+
+#include <functional>
+#include <memory>
+
+namespace CppReadline {
+    /**
+     * @brief This is the interface through which Console schedules all of its asynchronous work.
+     *
+     * Implement it to make Console share an existing thread pool with the
+     * rest of your program, rather than spawning threads of its own.
+     */
+    class Executor {
+        public:
+            using Task = std::function<void()>;
+
+            virtual ~Executor() = default;
+
+            /**
+             * @brief This function schedules a task to be run at some point, on any thread.
+             *
+             * @param task The task to run.
+             */
+            virtual void execute(Task task) = 0;
+    };
+
+    /**
+     * @brief A simple fixed-size thread pool, used by default by Console.
+     */
+    class ThreadPool : public Executor {
+        public:
+            /**
+             * @brief Basic constructor.
+             *
+             * @param threads The number of worker threads. Zero means one per hardware thread.
+             */
+            explicit ThreadPool(unsigned threads = 0);
+
+            /**
+             * @brief Basic destructor.
+             *
+             * Runs all tasks which are still queued, and then joins the workers.
+             */
+            ~ThreadPool();
+
+            void execute(Task task) override;
+
+            /**
+             * @brief This function returns the Executor shared by all Consoles which were not given one.
+             *
+             * The pool is created on the first call, so programs which never do
+             * asynchronous work never start any thread.
+             *
+             * @return The default Executor.
+             */
+            static std::shared_ptr<Executor> getDefault();
+
+        private:
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool(ThreadPool&&) = delete;
+            ThreadPool& operator = (ThreadPool const&) = delete;
+            ThreadPool& operator = (ThreadPool&&) = delete;
+
+            struct Impl;
+            using PImpl = ::std::unique_ptr<Impl>;
+            PImpl pimpl_;
+    };
+}
+
+#endif
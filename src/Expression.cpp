@@ -0,0 +1,207 @@
+#include "Expression.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace CppReadline {
+    namespace {
+        using Unary = double(*)(double);
+        using Binary = double(*)(double, double);
+
+        double min(double a, double b) { return std::min(a, b); }
+        double max(double a, double b) { return std::max(a, b); }
+
+        struct Function {
+            const char *    name;
+            Unary           unary;
+            Binary          binary;
+        };
+
+        const Function functions[] = {
+            { "abs",    static_cast<Unary>(std::fabs), nullptr },
+            { "ceil",   static_cast<Unary>(std::ceil), nullptr },
+            { "cos",    static_cast<Unary>(std::cos), nullptr },
+            { "exp",    static_cast<Unary>(std::exp), nullptr },
+            { "floor",  static_cast<Unary>(std::floor), nullptr },
+            { "log",    static_cast<Unary>(std::log), nullptr },
+            { "max",    nullptr, &max },
+            { "min",    nullptr, &min },
+            { "pow",    nullptr, static_cast<Binary>(std::pow) },
+            { "sin",    static_cast<Unary>(std::sin), nullptr },
+            { "sqrt",   static_cast<Unary>(std::sqrt), nullptr },
+            { "tan",    static_cast<Unary>(std::tan), nullptr },
+        };
+
+        // How deeply expressions may nest, so that parsing them cannot overflow the stack.
+        constexpr size_t maxNesting = 256;
+    }
+
+    // A recursive descent parser, which emits instructions in postfix order.
+    struct Expression::Parser {
+        Expression &        expression;
+        const std::string & text;
+        size_t              position;
+        size_t              depth;
+        size_t              nesting;
+
+        void fail(const std::string & message) const {
+            throw std::invalid_argument(message + " at position " + std::to_string(position));
+        }
+
+        char peek() {
+            while ( position < text.size() && std::isspace(static_cast<unsigned char>(text[position])) ) ++position;
+            return position < text.size() ? text[position] : '\0';
+        }
+
+        void emit(Op op, double value = 0.0, size_t index = 0) {
+            expression.program_.push_back(Instruction{op, value, index});
+            switch ( op ) {
+                case Op::Push: case Op::Load:
+                    expression.maxDepth_ = std::max(expression.maxDepth_, ++depth);
+                    break;
+                case Op::Neg: case Op::Call1:
+                    break;
+                default:
+                    --depth;
+            }
+        }
+
+        // expression := term (('+' | '-') term)*
+        void parseExpression() {
+            parseTerm();
+            char c;
+            while ( ( c = peek() ) == '+' || c == '-' ) {
+                ++position;
+                parseTerm();
+                emit(c == '+' ? Op::Add : Op::Sub);
+            }
+        }
+
+        // term := unary (('*' | '/' | '%') unary)*
+        void parseTerm() {
+            parseUnary();
+            char c;
+            while ( ( c = peek() ) == '*' || c == '/' || c == '%' ) {
+                ++position;
+                parseUnary();
+                emit(c == '*' ? Op::Mul : c == '/' ? Op::Div : Op::Mod);
+            }
+        }
+
+        // unary := ('-' | '+') unary | power
+        // Every recursion of the grammar goes through here, so this is where nesting is limited.
+        void parseUnary() {
+            if ( ++nesting > maxNesting ) fail("Expression nested too deeply");
+            char c = peek();
+            if ( c == '-' || c == '+' ) {
+                ++position;
+                parseUnary();
+                if ( c == '-' ) emit(Op::Neg);
+            } else {
+                parsePower();
+            }
+            --nesting;
+        }
+
+        // power := primary ('^' unary)?, which is right associative.
+        void parsePower() {
+            parsePrimary();
+            if ( peek() == '^' ) {
+                ++position;
+                parseUnary();
+                emit(Op::Pow);
+            }
+        }
+
+        // primary := number | variable | function '(' arguments ')' | '(' expression ')'
+        void parsePrimary() {
+            char c = peek();
+            if ( c == '(' ) {
+                ++position;
+                parseExpression();
+                if ( peek() != ')' ) fail("Expected ')'");
+                ++position;
+            } else if ( std::isdigit(static_cast<unsigned char>(c)) || c == '.' ) {
+                const char * begin = text.c_str() + position;
+                char * end;
+                double value = std::strtod(begin, &end);
+                if ( end == begin ) fail("Malformed number");
+                position += end - begin;
+                emit(Op::Push, value);
+            } else if ( std::isalpha(static_cast<unsigned char>(c)) || c == '_' ) {
+                size_t begin = position;
+                while ( position < text.size() &&
+                        ( std::isalnum(static_cast<unsigned char>(text[position])) || text[position] == '_' ) )
+                    ++position;
+                std::string name = text.substr(begin, position - begin);
+
+                if ( peek() == '(' ) parseCall(name);
+                else                 parseVariable(name);
+            } else {
+                fail(c ? std::string("Unexpected '") + c + "'" : "Unexpected end of expression");
+            }
+        }
+
+        void parseCall(const std::string & name) {
+            auto function = std::find_if(std::begin(functions), std::end(functions),
+                    [&name](const Function & f) { return name == f.name; });
+            if ( function == std::end(functions) ) fail("Unknown function '" + name + "'");
+
+            ++position;
+            parseExpression();
+            if ( function->binary ) {
+                if ( peek() != ',' ) fail("Expected ','");
+                ++position;
+                parseExpression();
+            }
+            if ( peek() != ')' ) fail("Expected ')'");
+            ++position;
+
+            emit(function->binary ? Op::Call2 : Op::Call1, 0.0, function - std::begin(functions));
+        }
+
+        void parseVariable(const std::string & name) {
+            auto & variables = expression.variables_;
+            auto it = std::find(variables.begin(), variables.end(), name);
+            if ( it == variables.end() ) it = variables.insert(variables.end(), name);
+
+            emit(Op::Load, 0.0, it - variables.begin());
+        }
+    };
+
+    Expression::Expression(const std::string & text) : program_(), variables_(), maxDepth_(0) {
+        Parser parser{*this, text, 0, 0, 0};
+        parser.parseExpression();
+        if ( parser.peek() != '\0' ) parser.fail(std::string("Unexpected '") + parser.peek() + "'");
+    }
+
+    const std::vector<std::string> & Expression::getVariables() const {
+        return variables_;
+    }
+
+    double Expression::evaluate(const std::vector<double> & values) const {
+        std::vector<double> stack(maxDepth_);
+        double * s = stack.data();
+        size_t n = 0; // How many values are on the stack.
+
+        for ( auto & i : program_ ) {
+            switch ( i.op ) {
+                case Op::Push:  s[n++] = i.value; break;
+                case Op::Load:  s[n++] = values[i.index]; break;
+                case Op::Add:   --n; s[n - 1] += s[n]; break;
+                case Op::Sub:   --n; s[n - 1] -= s[n]; break;
+                case Op::Mul:   --n; s[n - 1] *= s[n]; break;
+                case Op::Div:   --n; s[n - 1] /= s[n]; break;
+                case Op::Mod:   --n; s[n - 1] = std::fmod(s[n - 1], s[n]); break;
+                case Op::Pow:   --n; s[n - 1] = std::pow(s[n - 1], s[n]); break;
+                case Op::Neg:   s[n - 1] = -s[n - 1]; break;
+                case Op::Call1: s[n - 1] = functions[i.index].unary(s[n - 1]); break;
+                case Op::Call2: --n; s[n - 1] = functions[i.index].binary(s[n - 1], s[n]); break;
+            }
+        }
+        return s[n - 1];
+    }
+}
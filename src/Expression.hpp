@@ -0,0 +1,62 @@
+#ifndef CONSOLE_EXPRESSION_HEADER_FILE
+#define CONSOLE_EXPRESSION_HEADER_FILE
+
+#include <string>
+#include <vector>
+
+namespace CppReadline {
+    /**
+     * @brief This class is an arithmetic expression compiled to a flat postfix program.
+     *
+     * Expressions support numbers, variables, the operators + - * / % ^
+     * with the usual precedence, parentheses, and the functions abs, ceil,
+     * cos, exp, floor, log, max, min, pow, sin, sqrt and tan.
+     *
+     * Compiling is done once, after which evaluating the expression is just a
+     * loop over its instructions, so it is cheap to evaluate it repeatedly.
+     */
+    class Expression {
+        public:
+            /**
+             * @brief This constructor compiles an expression.
+             *
+             * @param text The expression to compile.
+             *
+             * @throw std::invalid_argument If the expression is malformed, or nested too deeply.
+             */
+            explicit Expression(const std::string & text);
+
+            /**
+             * @brief This function returns the names of the variables used by the expression.
+             *
+             * @return The variables, in the order their values have to be passed to evaluate().
+             */
+            const std::vector<std::string> & getVariables() const;
+
+            /**
+             * @brief This function evaluates the expression.
+             *
+             * @param values The values of the variables, in the same order as getVariables().
+             *
+             * @return The result of the expression.
+             */
+            double evaluate(const std::vector<double> & values) const;
+
+        private:
+            enum class Op { Push, Load, Add, Sub, Mul, Div, Mod, Pow, Neg, Call1, Call2 };
+            struct Instruction {
+                Op      op;
+                double  value;  // For Push
+                size_t  index;  // For Load and Call
+            };
+
+            std::vector<Instruction>    program_;
+            std::vector<std::string>    variables_;
+            size_t                      maxDepth_;
+
+            // Only used while compiling.
+            struct Parser;
+    };
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include "HistoryFile.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+
+namespace CppReadline {
+    namespace {
+        const char      Magic[]         = "CRLHIST1";
+        const size_t    BlockEntries    = 256;
+        const size_t    DictionaryWords = 1 << 16;
+
+        void putVarint(std::string & out, uint64_t value) {
+            while ( value >= 0x80 ) {
+                out += static_cast<char>((value & 0x7f) | 0x80);
+                value >>= 7;
+            }
+            out += static_cast<char>(value);
+        }
+
+        bool getVarint(const std::string & in, size_t & position, uint64_t & value) {
+            value = 0;
+            for ( unsigned shift = 0; position < in.size() && shift < 64; shift += 7 ) {
+                auto byte = static_cast<unsigned char>(in[position++]);
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ( ! (byte & 0x80) ) return true;
+            }
+            return false;
+        }
+
+        bool getVarint(std::istream & in, uint64_t & value) {
+            value = 0;
+            char c;
+            for ( unsigned shift = 0; shift < 64 && in.get(c); shift += 7 ) {
+                auto byte = static_cast<unsigned char>(c);
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ( ! (byte & 0x80) ) return true;
+            }
+            return false;
+        }
+
+        // Entries are split on single spaces, so that joining them back is lossless.
+        std::vector<std::string> words(const std::string & entry) {
+            std::vector<std::string> result;
+            size_t begin = 0, end;
+            while ( ( end = entry.find(' ', begin) ) != std::string::npos ) {
+                result.push_back(entry.substr(begin, end - begin));
+                begin = end + 1;
+            }
+            result.push_back(entry.substr(begin));
+            return result;
+        }
+    }
+
+    bool HistoryFile::save(const std::string & path, const std::vector<std::string> & entries) {
+        // Train the dictionary: words which save the most bytes go first, so they get the shortest ids.
+        std::unordered_map<std::string, uint64_t> counts;
+        for ( auto & entry : entries )
+            for ( auto & word : words(entry) )
+                if ( word.size() > 1 ) ++counts[word];
+
+        std::vector<std::pair<std::string, uint64_t>> candidates;
+        for ( auto & count : counts )
+            if ( count.second > 1 ) candidates.emplace_back(count.first, count.second * count.first.size());
+        std::sort(begin(candidates), end(candidates), [](const std::pair<std::string, uint64_t> & lhs,
+                                                         const std::pair<std::string, uint64_t> & rhs) {
+            return lhs.second != rhs.second ? lhs.second > rhs.second : lhs.first < rhs.first;
+        });
+        if ( candidates.size() > DictionaryWords ) candidates.resize(DictionaryWords);
+
+        std::unordered_map<std::string, uint64_t> ids;
+        std::string header(Magic, sizeof(Magic) - 1);
+        putVarint(header, candidates.size());
+        for ( auto & candidate : candidates ) {
+            ids.emplace(candidate.first, ids.size());
+            putVarint(header, candidate.first.size());
+            header += candidate.first;
+        }
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if ( ! file ) return false;
+        file.write(header.data(), header.size());
+
+        // Each block is: entry count, payload size, payload. Within the
+        // payload, each entry is the number of words it shares with the
+        // previous entry, the number of its other words, and those words:
+        // either a dictionary id (odd) or a literal length (even) plus bytes.
+        std::string payload, block;
+        for ( size_t first = 0; first < entries.size(); first += BlockEntries ) {
+            size_t last = std::min(entries.size(), first + BlockEntries);
+            payload.clear();
+            std::vector<std::string> previous;
+            for ( size_t i = first; i < last; ++i ) {
+                auto current = words(entries[i]);
+                size_t shared = 0;
+                while ( shared < previous.size() && shared < current.size() && previous[shared] == current[shared] )
+                    ++shared;
+
+                putVarint(payload, shared);
+                putVarint(payload, current.size() - shared);
+                for ( size_t w = shared; w < current.size(); ++w ) {
+                    auto id = ids.find(current[w]);
+                    if ( id != end(ids) ) {
+                        putVarint(payload, id->second * 2 + 1);
+                    } else {
+                        putVarint(payload, current[w].size() * 2);
+                        payload += current[w];
+                    }
+                }
+                previous = std::move(current);
+            }
+            block.clear();
+            putVarint(block, last - first);
+            putVarint(block, payload.size());
+            file.write(block.data(), block.size());
+            file.write(payload.data(), payload.size());
+        }
+        return static_cast<bool>(file.flush());
+    }
+
+    HistoryFile::HistoryFile(const std::string & path) :
+            path_(path), valid_(false), dictionary_(), blocks_()
+    {
+        std::ifstream file(path_, std::ios::binary);
+        if ( ! file.seekg(0, std::ios::end) ) return;
+        const uint64_t length = static_cast<uint64_t>(file.tellg());
+        file.seekg(0);
+        // Sizes come from the file, so they are checked against what is left of it before use.
+        auto remaining = [&file, length]() { return length - static_cast<uint64_t>(file.tellg()); };
+
+        char magic[sizeof(Magic) - 1];
+        if ( ! file.read(magic, sizeof(magic)) || ! std::equal(magic, magic + sizeof(magic), Magic) ) return;
+
+        uint64_t count, size;
+        if ( ! getVarint(file, count) || count > remaining() ) return;
+        for ( uint64_t i = 0; i < count; ++i ) {
+            std::string word;
+            if ( ! getVarint(file, size) || size > remaining() ) return;
+            word.resize(size);
+            if ( size && ! file.read(&word[0], size) ) return;
+            dictionary_.push_back(std::move(word));
+        }
+        // Only block headers are read here, payloads are skipped until needed.
+        Block block;
+        while ( getVarint(file, block.entries) ) {
+            // Each entry takes at least two bytes.
+            if ( ! getVarint(file, block.size) || block.size > remaining() || block.entries > block.size / 2 ) return;
+            block.offset = file.tellg();
+            if ( ! file.seekg(block.size, std::ios::cur) ) return;
+            blocks_.push_back(block);
+        }
+        valid_ = true;
+    }
+
+    HistoryFile::operator bool() const {
+        return valid_;
+    }
+
+    size_t HistoryFile::size() const {
+        size_t total = 0;
+        for ( auto & block : blocks_ ) total += block.entries;
+        return total;
+    }
+
+    std::vector<std::string> HistoryFile::decode(const Block & block) const {
+        std::vector<std::string> entries;
+
+        std::ifstream file(path_, std::ios::binary);
+        std::string payload(block.size, '\0');
+        if ( ! file.seekg(block.offset) || ! file.read(&payload[0], payload.size()) ) return entries;
+
+        size_t position = 0;
+        std::vector<std::string> previous;
+        for ( uint64_t i = 0; i < block.entries; ++i ) {
+            uint64_t shared, count, code;
+            if ( ! getVarint(payload, position, shared) || ! getVarint(payload, position, count) ||
+                 shared > previous.size() )
+                break;
+
+            previous.resize(shared);
+            for ( uint64_t w = 0; w < count; ++w ) {
+                if ( ! getVarint(payload, position, code) ) return entries;
+                if ( code & 1 ) {
+                    if ( code / 2 >= dictionary_.size() ) return entries;
+                    previous.push_back(dictionary_[code / 2]);
+                } else {
+                    if ( payload.size() - position < code / 2 ) return entries;
+                    previous.push_back(payload.substr(position, code / 2));
+                    position += code / 2;
+                }
+            }
+
+            std::string entry;
+            for ( size_t w = 0; w < previous.size(); ++w ) {
+                if ( w ) entry += ' ';
+                entry += previous[w];
+            }
+            entries.push_back(std::move(entry));
+        }
+        return entries;
+    }
+
+    std::vector<std::string> HistoryFile::load() const {
+        std::vector<std::string> entries;
+        entries.reserve(size());
+        for ( auto & block : blocks_ ) {
+            auto decoded = decode(block);
+            std::move(begin(decoded), end(decoded), std::back_inserter(entries));
+        }
+        return entries;
+    }
+
+    std::vector<std::string> HistoryFile::search(const std::string & text, size_t limit) const {
+        std::vector<std::string> matches;
+        for ( auto block = blocks_.rbegin(); block != blocks_.rend() && matches.size() < limit; ++block ) {
+            auto decoded = decode(*block);
+            for ( auto entry = decoded.rbegin(); entry != decoded.rend() && matches.size() < limit; ++entry )
+                if ( entry->find(text) != std::string::npos ) matches.push_back(std::move(*entry));
+        }
+        return matches;
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef CONSOLE_HISTORY_FILE_HEADER_FILE
+#define CONSOLE_HISTORY_FILE_HEADER_FILE
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace CppReadline {
+    /**
+     * @brief This class reads and writes compact history files.
+     *
+     * Histories are very repetitive, so entries are stored as references to
+     * a dictionary of the words which appear most often in the whole file,
+     * and each entry only stores the words which differ from the previous
+     * one. Entries are grouped in blocks, so that searching only needs to
+     * decode blocks until enough results are found.
+     *
+     * Opening a file only reads the dictionary and the position of each
+     * block.
+     */
+    class HistoryFile {
+        public:
+            /**
+             * @brief This function writes a history file, replacing it if it exists.
+             *
+             * @param path The pathname of the file.
+             * @param entries The history entries, oldest first.
+             *
+             * @return Whether the file was written successfully.
+             */
+            static bool save(const std::string & path, const std::vector<std::string> & entries);
+
+            /**
+             * @brief Basic constructor.
+             *
+             * @param path The pathname of the file to open.
+             */
+            explicit HistoryFile(const std::string & path);
+
+            /**
+             * @brief Whether the file could be opened and is a valid history file.
+             */
+            explicit operator bool() const;
+
+            /**
+             * @brief This function returns how many entries the file contains.
+             */
+            size_t size() const;
+
+            /**
+             * @brief This function decodes all entries in the file.
+             *
+             * @return All entries, oldest first.
+             */
+            std::vector<std::string> load() const;
+
+            /**
+             * @brief This function finds the most recent entries containing some text.
+             *
+             * Blocks are decoded newest first, and only until enough entries are found.
+             *
+             * @param text The text to look for.
+             * @param limit How many entries to return at most.
+             *
+             * @return The matching entries, newest first.
+             */
+            std::vector<std::string> search(const std::string & text, size_t limit) const;
+
+        private:
+            struct Block {
+                uint64_t offset;
+                uint64_t size;
+                uint64_t entries;
+            };
+
+            std::string                 path_;
+            bool                        valid_;
+            std::vector<std::string>    dictionary_;
+            std::vector<Block>          blocks_;
+
+            std::vector<std::string> decode(const Block & block) const;
+    };
+}
+
+#endif
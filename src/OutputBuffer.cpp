@@ -0,0 +1,111 @@
+#include "OutputBuffer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <poll.h>
+#include <unistd.h>
+
+namespace CppReadline {
+    OutputBuffer::OutputBuffer(int fd) :
+            fd_(fd),
+            policy_{ 1 << 16, std::chrono::milliseconds(50), std::chrono::milliseconds(200), Policy::Overflow::Block },
+            buffer_(policy_.capacity), heldSince_(Clock::now()),
+            droppedLines_(0), unreportedLines_(0), atLineStart_(true)
+    {
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+    OutputBuffer::~OutputBuffer() {
+        drain();
+    }
+
+    void OutputBuffer::setPolicy(const Policy & policy) {
+        flush();
+        policy_ = policy;
+        buffer_.resize(std::max<size_t>(policy_.capacity, 1));
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+    void OutputBuffer::flush() {
+        drain();
+    }
+
+    unsigned long OutputBuffer::getDroppedLines() const {
+        return droppedLines_;
+    }
+
+    OutputBuffer::int_type OutputBuffer::overflow(int_type c) {
+        drain();
+        if ( ! traits_type::eq_int_type(c, traits_type::eof()) ) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize OutputBuffer::xsputn(const char * s, std::streamsize n) {
+        // The latency counts from the oldest output still held back.
+        const auto now = Clock::now();
+        if ( pptr() == pbase() ) heldSince_ = now;
+
+        std::streamsize written = 0;
+        while ( written < n ) {
+            if ( pptr() == epptr() ) drain();
+            auto chunk = std::min<std::streamsize>(n - written, epptr() - pptr());
+            std::memcpy(pptr(), s + written, chunk);
+            pbump(static_cast<int>(chunk));
+            written += chunk;
+        }
+        if ( now - heldSince_ >= policy_.latency ) drain();
+        return n;
+    }
+
+    int OutputBuffer::sync() {
+        drain();
+        return 0;
+    }
+
+    void OutputBuffer::drain() {
+        heldSince_ = Clock::now();
+        const size_t size = pptr() - pbase();
+        if ( size == 0 && unreportedLines_ == 0 ) return;
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+
+        // Anything printed through C stdio must come out first.
+        std::fflush(stdout);
+
+        pollfd fd{ fd_, POLLOUT, 0 };
+        const int patience = policy_.overflow == Policy::Overflow::Block ? -1 : static_cast<int>(policy_.patience.count());
+        int ready;
+        while ( ( ready = poll(&fd, 1, patience) ) < 0 && errno == EINTR );
+
+        if ( ready == 0 ) {
+            // The descriptor is too slow, so we drop what we have.
+            auto lines = static_cast<unsigned long>(std::count(buffer_.data(), buffer_.data() + size, '\n'));
+            droppedLines_ += lines;
+            unreportedLines_ += lines;
+            return;
+        }
+        if ( unreportedLines_ > 0 ) {
+            auto summary = std::string(atLineStart_ ? "" : "\n") + "[... " + std::to_string(unreportedLines_) + " lines of output dropped ...]\n";
+            unreportedLines_ = 0;
+            if ( writeAll(summary.data(), summary.size()) ) atLineStart_ = true;
+        }
+        if ( writeAll(buffer_.data(), size) && size > 0 )
+            atLineStart_ = buffer_[size - 1] == '\n';
+    }
+
+    bool OutputBuffer::writeAll(const char * data, size_t size) {
+        while ( size > 0 ) {
+            ssize_t r = write(fd_, data, size);
+            if ( r < 0 && errno == EINTR ) continue;
+            if ( r <= 0 ) return false;
+            data += r; size -= r;
+        }
+        return true;
+    }
+}
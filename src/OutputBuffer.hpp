@@ -0,0 +1,84 @@
+#ifndef CONSOLE_OUTPUT_BUFFER_HEADER_FILE
+#define CONSOLE_OUTPUT_BUFFER_HEADER_FILE
+
+#include <chrono>
+#include <streambuf>
+#include <vector>
+
+namespace CppReadline {
+    /**
+     * @brief This class coalesces output into large writes to a file descriptor.
+     *
+     * Output is held back until the buffer is full, or until it has been
+     * waiting for longer than the latency of the policy. Explicit flushes
+     * (like std::flush or std::endl) always write it out, so that prompts
+     * appear before reading input; printing '\n' instead of std::endl lets
+     * many short lines go out together.
+     *
+     * Before each write the descriptor is checked: if it cannot take more
+     * output within the patience of the policy, it is considered slow, and
+     * the output is either waited for (Block) or discarded (Drop). Discarded
+     * output is summarized once the descriptor is writable again.
+     */
+    class OutputBuffer : public std::streambuf {
+        public:
+            struct Policy {
+                enum class Overflow { Block, Drop };
+
+                size_t                      capacity;   // How many bytes are coalesced at most.
+                std::chrono::milliseconds   latency;    // How long output can be held back.
+                std::chrono::milliseconds   patience;   // How long a slow descriptor is waited for before dropping.
+                Overflow                    overflow;
+            };
+
+            /**
+             * @brief Basic constructor.
+             *
+             * The default policy coalesces up to 64KiB for up to 50ms, and blocks on a slow descriptor.
+             *
+             * @param fd The file descriptor to write to.
+             */
+            explicit OutputBuffer(int fd);
+
+            /**
+             * @brief Writes out whatever is still buffered.
+             */
+            ~OutputBuffer();
+
+            /**
+             * @brief Sets the policy of this buffer, flushing it first.
+             */
+            void setPolicy(const Policy & policy);
+
+            /**
+             * @brief Writes out whatever is buffered, regardless of the latency.
+             */
+            void flush();
+
+            /**
+             * @brief Returns how many lines have been dropped so far.
+             */
+            unsigned long getDroppedLines() const;
+
+        protected:
+            int_type overflow(int_type c) override;
+            std::streamsize xsputn(const char * s, std::streamsize n) override;
+            int sync() override;
+
+        private:
+            using Clock = std::chrono::steady_clock;
+
+            // Writes out the buffer, or drops it if the descriptor is too slow.
+            void drain();
+            bool writeAll(const char * data, size_t size);
+
+            int                 fd_;
+            Policy              policy_;
+            std::vector<char>   buffer_;
+            Clock::time_point   heldSince_;     // When the oldest buffered output was written.
+            unsigned long       droppedLines_, unreportedLines_;
+            bool                atLineStart_;   // Whether the last byte written was a newline.
+    };
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "ScriptReader.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CppReadline {
+    namespace {
+        constexpr size_t BlockSize  = 1 << 20;
+        constexpr size_t ReadAhead  = 4;
+
+        using Block = std::vector<char>;
+
+        // The descriptor is shared with all reads in flight, and closed by the last one.
+        struct File {
+            int fd;
+
+            explicit File(int f) : fd(f) {}
+            ~File() { if ( fd >= 0 ) close(fd); }
+
+            File(File const&) = delete;
+            File& operator = (File const&) = delete;
+
+            Block read(off_t offset, size_t length = BlockSize) const {
+                Block block(length);
+                size_t size = 0;
+                while ( size < block.size() ) {
+                    ssize_t r = pread(fd, block.data() + size, block.size() - size, offset + size);
+                    if ( r < 0 && errno == EINTR ) continue;
+                    // Errors are treated as the end of the file.
+                    if ( r <= 0 ) break;
+                    size += r;
+                }
+                // Short blocks end the file, and may be kept for as long as the script runs.
+                if ( size < block.size() ) {
+                    block.resize(size);
+                    block.shrink_to_fit();
+                }
+                return block;
+            }
+        };
+
+        // A block being read ahead. Whoever takes it first reads it: the
+        // Executor, or the reader itself if the Executor has not got to it yet.
+        struct Pending {
+            off_t                               offset;
+            std::shared_ptr<std::atomic<bool>>  taken;
+            std::future<Block>                  block;
+        };
+    }
+
+    struct ScriptReader::Impl {
+        Executor &                      executor_;
+        std::shared_ptr<File>           file_;
+        std::deque<Pending>             pending_;
+        off_t                           nextOffset_ = 0;
+        bool                            lastIssued_ = false;
+
+        Block   current_;
+        size_t  position_ = 0;
+
+        Impl(const std::string & filename, Executor & executor) :
+                executor_(executor),
+                file_(std::make_shared<File>(open(filename.c_str(), O_RDONLY | O_CLOEXEC))),
+                pending_(), current_()
+        {
+            if ( file_->fd < 0 ) return;
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(file_->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            // Most scripts fit in a single block, so we read it right away and
+            // only start reading ahead if there is more. Small scripts only
+            // get a block as large as they are.
+            struct stat info;
+            size_t first = BlockSize;
+            if ( fstat(file_->fd, &info) == 0 && S_ISREG(info.st_mode) && static_cast<size_t>(info.st_size) < BlockSize )
+                first = info.st_size;
+            current_ = file_->read(0, first);
+            nextOffset_ = current_.size();
+            if ( current_.size() < BlockSize ) lastIssued_ = true;
+            while ( pending_.size() < ReadAhead && ! lastIssued_ ) issue();
+        }
+
+        Impl(Impl const&) = delete;
+        Impl(Impl&&) = delete;
+        Impl& operator = (Impl const&) = delete;
+        Impl& operator = (Impl&&) = delete;
+
+        void issue() {
+            auto file = file_;
+            auto offset = nextOffset_;
+            auto taken = std::make_shared<std::atomic<bool>>(false);
+            auto result = std::make_shared<std::promise<Block>>();
+            pending_.push_back(Pending{offset, taken, result->get_future()});
+            nextOffset_ += BlockSize;
+
+            executor_.execute([file, offset, taken, result]{
+                result->set_value(taken->exchange(true) ? Block() : file->read(offset));
+            });
+        }
+
+        // Replaces the current block with the next one, returning false at the end of the file.
+        bool advance() {
+            if ( pending_.empty() ) return false;
+
+            // We may be running on the Executor ourselves, so we never wait
+            // for a read which has not started.
+            auto & next = pending_.front();
+            current_ = next.taken->exchange(true) ? next.block.get() : file_->read(next.offset);
+            pending_.pop_front();
+            position_ = 0;
+
+            if ( current_.size() < BlockSize ) {
+                // Whatever is still in flight is past the end of the file.
+                lastIssued_ = true;
+                pending_.clear();
+            } else if ( ! lastIssued_ ) {
+                issue();
+            }
+            return ! current_.empty();
+        }
+    };
+
+    ScriptReader::ScriptReader(const std::string & filename, Executor & executor)
+        : pimpl_{ new Impl{ filename, executor } } {}
+
+    ScriptReader::~ScriptReader() = default;
+
+    ScriptReader::operator bool() const {
+        return pimpl_->file_->fd >= 0;
+    }
+
+    bool ScriptReader::getline(std::string & line) {
+        line.clear();
+        if ( ! *this ) return false;
+
+        bool extracted = false;
+        do {
+            auto & block = pimpl_->current_;
+            auto & position = pimpl_->position_;
+            if ( position == block.size() ) continue;
+
+            const char * begin = block.data() + position;
+            const char * newline = static_cast<const char *>(std::memchr(begin, '\n', block.size() - position));
+            if ( newline ) {
+                line.append(begin, newline);
+                position += newline - begin + 1;
+                return true;
+            }
+            line.append(begin, block.size() - position);
+            position = block.size();
+            extracted = true;
+        } while ( pimpl_->advance() );
+
+        return extracted;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef CONSOLE_SCRIPT_READER_HEADER_FILE
+#define CONSOLE_SCRIPT_READER_HEADER_FILE
+
+#include <memory>
+#include <string>
+
+#include "Executor.hpp"
+
+namespace CppReadline {
+    /**
+     * @brief This class reads a script line by line, keeping several reads in flight ahead of the caller.
+     *
+     * The file is read in large blocks on the Executor, so that executing a
+     * sequential script does not stall every time a buffer needs to be
+     * refilled from a slow disk.
+     */
+    class ScriptReader {
+        public:
+            /**
+             * @brief Basic constructor.
+             *
+             * Opens the file and synchronously reads its first block.
+             *
+             * @param filename The pathname of the script.
+             * @param executor The Executor on which read-ahead is scheduled.
+             */
+            ScriptReader(const std::string & filename, Executor & executor);
+
+            /**
+             * @brief Basic destructor.
+             *
+             * Reads still in flight are not waited for, and the file is closed
+             * once the last of them is done.
+             */
+            ~ScriptReader();
+
+            /**
+             * @brief Whether the file could be opened.
+             */
+            explicit operator bool() const;
+
+            /**
+             * @brief This function reads the next line, without its newline, as std::getline would.
+             *
+             * @param line The string where to store the line.
+             *
+             * @return Whether a line was read.
+             */
+            bool getline(std::string & line);
+
+        private:
+            ScriptReader(const ScriptReader&) = delete;
+            ScriptReader(ScriptReader&&) = delete;
+            ScriptReader& operator = (ScriptReader const&) = delete;
+            ScriptReader& operator = (ScriptReader&&) = delete;
+
+            struct Impl;
+            using PImpl = ::std::unique_ptr<Impl>;
+            PImpl pimpl_;
+    };
+}
+
+#endif